@@ -0,0 +1,168 @@
+#include <cstdlib>
+#include <memory>
+#include <sstream>
+#include "bench.hh"
+#include "builtins.hh"
+#include "eval.hh"
+#include "gc.hh"
+#include "parser.hh"
+
+// Measures pair allocation throughput: builds short lists and drops
+// them, as argument lists and quasiquote results are, so nearly every
+// pair dies young. The same pattern is timed on the collector's
+// nursery, on plain new and delete, and on shared_ptr, then run as a
+// Scheme program to show the collector's pause times. Requests that
+// each allocate a long list are handled with and without a region of
+// their own. Then a major collection of a heap holding a long list is
+// made in one pause and incrementally while the program churns. Last,
+// all but one pair in twenty of the list is dropped, and the collection
+// that compacts the survivors is timed.
+
+namespace {
+
+const int pairsPerList = 10;
+
+struct PlainPair {
+    long car;
+    PlainPair *cdr;
+};
+
+struct SharedPair {
+    long car;
+    std::shared_ptr<SharedPair> cdr;
+};
+
+void reportRate(const std::string& name, double seconds, long pairs)
+{
+    report(name, seconds * 1e9 / pairs, "ns/pair");
+}
+
+void reportPauses(const HeapStats& before, const HeapStats& after)
+{
+    report("  minor collections",
+           after.minorCollections - before.minorCollections);
+    report("  major collections", after.collections - before.collections);
+    report("  pairs promoted", after.promoted - before.promoted);
+    report("  total pause", (after.pauseSeconds - before.pauseSeconds) * 1e3,
+           "ms");
+    report("  median pause", after.medianPauseSeconds * 1e6, "us");
+    report("  99th percentile pause", after.pause99Seconds * 1e6, "us");
+    report("  longest pause", after.longestPauseSeconds * 1e6, "us");
+}
+
+} // end namespace
+
+int main(int argc, char **argv)
+{
+    long lists = argc > 1 ? std::atol(argv[1]) : 1000000;
+    long pairs = lists * pairsPerList;
+    long checksum = 0;
+
+    resetPauseStats();
+    auto before = heapStats();
+    double seconds = secondsToRun([&] {
+        for (long i = 0; i < lists; ++i) {
+            SchemeExpr list = Nil::Nil;
+            for (int j = 0; j < pairsPerList; ++j) list = cons(j, list);
+            checksum += asCons(list)->car.fixnum();
+            safePoint();
+        }
+    });
+    reportRate("nursery", seconds, pairs);
+    reportPauses(before, heapStats());
+
+    seconds = secondsToRun([&] {
+        for (long i = 0; i < lists; ++i) {
+            PlainPair *list = nullptr;
+            for (int j = 0; j < pairsPerList; ++j) {
+                list = new PlainPair{ j, list };
+            }
+            checksum += list->car;
+            while (list) {
+                PlainPair *next = list->cdr;
+                delete list;
+                list = next;
+            }
+        }
+    });
+    reportRate("new and delete", seconds, pairs);
+
+    seconds = secondsToRun([&] {
+        for (long i = 0; i < lists; ++i) {
+            std::shared_ptr<SharedPair> list;
+            for (int j = 0; j < pairsPerList; ++j) {
+                list = std::make_shared<SharedPair>(SharedPair{ j, list });
+            }
+            checksum += list->car;
+        }
+    });
+    reportRate("shared_ptr", seconds, pairs);
+
+    auto env = standardEnvironment();
+    std::istringstream program(
+        "(define build (lambda (n acc)"
+        "  (if (= n 0) acc (build (- n 1) (cons n acc)))))"
+        "(define churn (lambda (n)"
+        "  (if (= n 0) 0 (begin (build 10 (quote ())) (churn (- n 1))))))");
+    evalStream(program, env);
+    std::ostringstream call;
+    call << "(churn " << lists / 10 << ")";
+    auto expr = parse(call.str());
+
+    resetPauseStats();
+    before = heapStats();
+    seconds = secondsToRun([&] { eval(expr, env); });
+    reportRate("scheme program", seconds, pairs / 10);
+    reportPauses(before, heapStats());
+
+    std::istringstream requests(
+        "(define request (lambda () (length (build 20000 (quote ())))))");
+    evalStream(requests, env);
+    for (auto call : { "(request)", "(with-region request)" }) {
+        auto request = parse(call);
+        collectGarbage();
+        resetPauseStats();
+        before = heapStats();
+        seconds = secondsToRun([&] {
+            for (int i = 0; i < 200; ++i) eval(request, env);
+        });
+        report(call, seconds * 1e3 / 200, "ms/request");
+        reportPauses(before, heapStats());
+    }
+
+    std::istringstream retaining("(define keep (build 500000 (quote ())))");
+    evalStream(retaining, env);
+    auto churn = parse("(churn 1000)");
+
+    for (double target : { 0.0, 100e-6 }) {
+        collectGarbage();
+        setPauseTarget(target);
+        resetPauseStats();
+        before = heapStats();
+        seconds = secondsToRun([&] {
+            startCollection();
+            while (collectionInProgress()) eval(churn, env);
+        });
+        report(target ? "incremental, 100us target" : "stop the world",
+               seconds * 1e3, "ms");
+        reportPauses(before, heapStats());
+    }
+    setPauseTarget(0);
+
+    std::istringstream thinning(
+        "(define thin (lambda (xs k acc)"
+        "  (if (null? xs) acc"
+        "    (if (= k 0) (thin (cdr xs) 19 (cons (car xs) acc))"
+        "      (thin (cdr xs) (- k 1) acc)))))"
+        "(define keep (thin keep 19 (quote ())))");
+    evalStream(thinning, env);
+    before = heapStats();
+    seconds = secondsToRun([&] { collectGarbage(); });
+    auto after = heapStats();
+    report("compacting collection", seconds * 1e3, "ms");
+    report("  heap before", before.bytes / 1e6, "MB");
+    report("  heap after", after.bytes / 1e6, "MB");
+    report("  compactions", after.compactions - before.compactions);
+
+    return checksum == 0;
+}
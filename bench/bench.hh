@@ -0,0 +1,37 @@
+#ifndef BENCH_HH
+#define BENCH_HH
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+// Minimal timing helpers shared by the benchmark programs. Each
+// benchmark is a standalone executable that prints one line per
+// measurement, so runs can be compared with diff.
+
+template <typename F>
+double secondsToRun(F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+inline void report(const std::string& name, double value,
+                   const std::string& unit)
+{
+    std::cout << std::left << std::setw(40) << name
+              << std::right << std::setw(14) << std::fixed
+              << std::setprecision(2) << value << " " << unit << std::endl;
+}
+
+inline void report(const std::string& name, long count)
+{
+    std::cout << std::left << std::setw(40) << name
+              << std::right << std::setw(14) << count << std::endl;
+}
+
+#endif
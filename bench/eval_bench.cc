@@ -0,0 +1,85 @@
+#include <cstdlib>
+#include <new>
+#include <sstream>
+#include <string>
+#include "bench.hh"
+#include "builtins.hh"
+#include "eval.hh"
+#include "parser.hh"
+
+// Counts the calls to operator new made by each eval() of a few small
+// expressions, on both evaluators, and by printing a list, to show
+// what the evaluator, the primitives and the printer copy. Each eval
+// analyzes or compiles its expression afresh, which accounts for some
+// of them; (fib 10) and (fib 15) show what the calls add. Pooled heap
+// objects and pairs in the nursery only reach operator new when a pool
+// or the nursery needs another chunk.
+
+namespace {
+
+std::size_t allocations = 0;
+
+const int runs = 10000;
+
+} // end namespace
+
+void *operator new(std::size_t size)
+{
+    ++allocations;
+    if (void *memory = std::malloc(size ? size : 1)) return memory;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void *memory, std::size_t) noexcept
+{
+    std::free(memory);
+}
+
+int main()
+{
+    const char *expressions[] = {
+        "(+ 1 2 3)", "(< 1 2 3)", "(car xs)", "(length xs)", "(append xs xs)",
+        "(fib 10)", "(fib 15)"
+    };
+
+    for (auto mode : { EvalMode::Tree, EvalMode::Bytecode }) {
+        setEvalMode(mode);
+        auto env = standardEnvironment();
+        std::istringstream program(
+            "(define xs (quote (1 2 3 4 5 6 7 8)))"
+            "(define fib (lambda (n)"
+            "  (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))");
+        evalStream(program, env);
+
+        std::string evaluator = mode == EvalMode::Tree ? "tree" : "vm";
+        for (auto source : expressions) {
+            auto expr = parse(source);
+            eval(expr, env);
+            std::size_t before = allocations;
+            double seconds = secondsToRun([&] {
+                for (int i = 0; i < runs; ++i) eval(expr, env);
+            });
+            report(evaluator + ", " + source,
+                   static_cast<double>(allocations - before) / runs,
+                   "allocations");
+            report("", seconds * 1e9 / runs, "ns");
+        }
+    }
+
+    auto xs = parse("(1 2 3 4 5 6 7 8)");
+    std::size_t before = allocations;
+    double seconds = secondsToRun([&] {
+        for (int i = 0; i < runs; ++i) {
+            std::ostringstream out;
+            out << xs;
+        }
+    });
+    report("printing (1 2 3 4 5 6 7 8)",
+           static_cast<double>(allocations - before) / runs, "allocations");
+    report("", seconds * 1e9 / runs, "ns");
+}
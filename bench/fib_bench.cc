@@ -0,0 +1,83 @@
+#include <cstring>
+#include <sstream>
+#include "bench.hh"
+#include "builtins.hh"
+#include "eval.hh"
+#include "gc.hh"
+#include "parser.hh"
+
+// Measures the cost of a procedure call on a call-heavy workload:
+// naive fib makes 2 * fib(n + 1) - 1 calls to itself. Pass --vm to
+// run it on the bytecode VM. Also counts the frames and other small
+// objects the calls allocated from the collector's pools, and how few
+// of those needed memory from the system.
+
+namespace {
+
+struct PoolTotals {
+    long allocations = 0;
+    long recycled = 0;
+    long chunks = 0;
+};
+
+PoolTotals poolTotals()
+{
+    PoolTotals totals;
+    for (const auto& pool : poolStats()) {
+        totals.allocations += pool.allocations;
+        totals.recycled += pool.recycled;
+        totals.chunks += pool.chunks;
+    }
+    return totals;
+}
+
+long callsFor(int n)
+{
+    long a = 0, b = 1;
+    for (int i = 0; i < n + 1; ++i) {
+        long next = a + b;
+        a = b;
+        b = next;
+    }
+    return 2 * a - 1;
+}
+
+} // end namespace
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && std::strcmp(argv[1], "--vm") == 0) {
+        setEvalMode(EvalMode::Bytecode);
+        --argc, ++argv;
+    }
+    int n = argc > 1 ? std::atoi(argv[1]) : 22;
+    auto env = standardEnvironment();
+    std::istringstream program(
+        "(define fib (lambda (n)"
+        "  (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))");
+    evalStream(program, env);
+
+    std::ostringstream call;
+    call << "(fib " << n << ")";
+    auto expr = parse(call.str());
+
+    SchemeExpr result;
+    auto before = heapStats();
+    auto pools = poolTotals();
+    double seconds = secondsToRun([&] { result = eval(expr, env); });
+    auto after = heapStats();
+    auto poolsAfter = poolTotals();
+    long calls = callsFor(n);
+
+    std::cout << call.str() << " = " << result << std::endl;
+    report("total time", seconds * 1e3, "ms");
+    report("calls", calls);
+    report("time per call", seconds * 1e9 / calls, "ns");
+    report("frames freed as calls returned",
+           after.framesReleased - before.framesReleased);
+    report("minor collections",
+           after.minorCollections - before.minorCollections);
+    report("pool allocations", poolsAfter.allocations - pools.allocations);
+    report("  reusing freed memory", poolsAfter.recycled - pools.recycled);
+    report("  chunks from the system", poolsAfter.chunks - pools.chunks);
+}
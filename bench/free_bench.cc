@@ -0,0 +1,52 @@
+#include <cstdlib>
+#include <string>
+#include "bench.hh"
+#include "gc.hh"
+#include "scheme_types.hh"
+
+// Measures how long the collector takes to free very large lists once
+// they are dropped: long lists, and lists nested as deeply through
+// their cars. Young ones are freed by a minor collection along with
+// the nursery's blocks, and old ones by a full collection sweeping the
+// old pair space. Neither recurses, so depth costs no more than length
+// and can't overflow the stack.
+
+namespace {
+
+SchemeExpr build(long pairs, bool nested)
+{
+    SchemeExpr list = Nil::Nil;
+    for (long i = 0; i < pairs; ++i) {
+        list = nested ? cons(list, Nil::Nil)
+                      : cons(static_cast<int>(i), list);
+    }
+    return list;
+}
+
+void timeFreeing(long pairs, bool nested)
+{
+    std::string shape = std::to_string(pairs / 1000000) + "M pairs, "
+        + (nested ? "nested" : "long");
+
+    SchemeExpr list = build(pairs, nested);
+    list = Nil::Nil;
+    double seconds = secondsToRun([] { collectPending(); });
+    report(shape + ", young", seconds * 1e3, "ms");
+
+    list = build(pairs, nested);
+    collectGarbage();
+    list = Nil::Nil;
+    seconds = secondsToRun([] { collectGarbage(); });
+    report(shape + ", old", seconds * 1e3, "ms");
+}
+
+} // end namespace
+
+int main(int argc, char **argv)
+{
+    long pairs = argc > 1 ? std::atol(argv[1]) : 1000000;
+
+    for (long size : { pairs, 10 * pairs }) {
+        for (bool nested : { false, true }) timeFreeing(size, nested);
+    }
+}
@@ -0,0 +1,92 @@
+#include <algorithm>
+#include <cstdlib>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "bench.hh"
+#include "builtins.hh"
+#include "gc.hh"
+#include "parser.hh"
+#include "printer.hh"
+
+// Measures traversal of long lists: length, append and printing, each
+// timed per pair. The first list's pairs are allocated in order, so
+// they sit next to each other in the nursery. The second's are
+// allocated in a shuffled order, as they would be spread over a
+// fragmented heap. The third is that same list once a collection has
+// copied it out of the nursery, which lays it out in list order again.
+
+namespace {
+
+const int runs = 5;
+
+SchemeFunction *primitive(const std::string& name)
+{
+    return functionPointer(eval(parse(name)));
+}
+
+void timeTraversal(const std::string& list, const SchemeExpr& xs, long n)
+{
+    SchemeFunction *length = primitive("length");
+    SchemeFunction *append = primitive("append");
+    long checksum = 0;
+
+    double seconds = secondsToRun([&] {
+        for (int i = 0; i < runs; ++i) {
+            checksum += intValue((*length)(SchemeArgs(&xs, 1)));
+        }
+    });
+    report(list + ", length", seconds * 1e9 / runs / n, "ns/pair");
+
+    SchemeExpr args[] = { xs, Nil::Nil };
+    seconds = secondsToRun([&] {
+        for (int i = 0; i < runs; ++i) {
+            SchemeExpr copy = (*append)(SchemeArgs(args, 2));
+            checksum += asCons(copy)->car.fixnum();
+        }
+    });
+    report(list + ", append", seconds * 1e9 / runs / n, "ns/pair");
+    collectGarbage();
+
+    seconds = secondsToRun([&] {
+        for (int i = 0; i < runs; ++i) {
+            std::ostringstream out;
+            out << xs;
+            checksum += out.str().size();
+        }
+    });
+    report(list + ", printing", seconds * 1e9 / runs / n, "ns/pair");
+
+    if (checksum == 0) std::cout << "unexpected checksum" << std::endl;
+}
+
+} // end namespace
+
+int main(int argc, char **argv)
+{
+    long n = argc > 1 ? std::atol(argv[1]) : 1000000;
+
+    std::vector<SchemeExpr> elements;
+    for (long i = 0; i < n; ++i) elements.push_back(static_cast<int>(i));
+    SchemeExpr sequential = consFromVector(elements);
+    elements.clear();
+    timeTraversal("sequential", sequential, n);
+    sequential = Nil::Nil;
+
+    // The cells are rooted while they're linked, and the links don't
+    // need a write barrier since they are all in the nursery
+    std::vector<SchemeExpr> cells;
+    for (long i = 0; i < n; ++i) {
+        cells.push_back(cons(static_cast<int>(i), Nil::Nil));
+    }
+    std::shuffle(cells.begin(), cells.end(), std::mt19937(42));
+    for (long i = 0; i + 1 < n; ++i) setCdr(asCons(cells[i]), cells[i + 1]);
+    SchemeExpr scattered = cells.front();
+    cells.clear();
+    timeTraversal("scattered", scattered, n);
+    collectGarbage();
+    timeTraversal("scattered, after a collection", scattered, n);
+
+    return 0;
+}
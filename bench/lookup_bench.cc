@@ -0,0 +1,68 @@
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include "bench.hh"
+#include "builtins.hh"
+#include "eval.hh"
+#include "parser.hh"
+
+// Measures variable lookups per second on each evaluator: references
+// to a parameter, to a variable two frames out and to a global. Each
+// loop makes a hundred references per iteration, and the time of the same
+// loop without them is subtracted. Each time is the fastest of a few
+// runs, so the difference isn't swamped by noise.
+
+namespace {
+
+const int references = 100;
+const int runs = 5;
+
+std::string loop(const std::string& name, const std::string& variable)
+{
+    std::string body;
+    for (int i = 0; i < references; ++i) body += variable + " ";
+    return "(lambda (n x) (if (= n 0) 0 (begin " + body + "(" + name
+        + " (- n 1) x))))";
+}
+
+double secondsFor(const std::string& name, long n, const EnvPointer& env)
+{
+    std::ostringstream call;
+    call << "(" << name << " " << n << " 0)";
+    auto expr = parse(call.str());
+    double fastest = secondsToRun([&] { eval(expr, env); });
+    for (int i = 1; i < runs; ++i) {
+        fastest = std::min(fastest, secondsToRun([&] { eval(expr, env); }));
+    }
+    return fastest;
+}
+
+} // end namespace
+
+int main(int argc, char **argv)
+{
+    long n = argc > 1 ? std::atol(argv[1]) : 100000;
+
+    for (auto mode : { EvalMode::Tree, EvalMode::Bytecode }) {
+        setEvalMode(mode);
+        auto env = standardEnvironment();
+        std::istringstream program(
+            "(define g 1)"
+            "(define none " + loop("none", "") + ")"
+            "(define local " + loop("local", "x") + ")"
+            "(define global " + loop("global", "g") + ")"
+            "(define outer ((lambda (y) ((lambda (z) "
+            + loop("outer", "y") + ") 0)) 1))");
+        evalStream(program, env);
+
+        std::string evaluator = mode == EvalMode::Tree ? "tree" : "vm";
+        double baseline = secondsFor("none", n, env);
+        for (auto name : { "local", "outer", "global" }) {
+            double seconds = secondsFor(name, n, env) - baseline;
+            double lookups = static_cast<double>(n) * references;
+            report(evaluator + ", " + name, lookups / seconds / 1e6,
+                   "M lookups/s");
+        }
+    }
+}
@@ -0,0 +1,85 @@
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "bench.hh"
+#include "builtins.hh"
+#include "eval.hh"
+#include "gc.hh"
+#include "parser.hh"
+
+// Measures how marking scales with threads. Builds a list of long
+// lists, then a binary tree of closures, each holding its children in
+// the environment it closes over, and times the marking in full
+// collections of each graph on 1, 2, 4 and 8 threads. A single long
+// list can't be shared out, since each pair is only found through the
+// one before it, so the graphs are made of many lists and branches.
+// Last it times a million or so strings that are each a root, like the
+// frames a deep non-tail recursion leaves on the stacks, which the
+// collecting thread has to deal out to the others before they start.
+
+namespace {
+
+const int runs = 5;
+
+void timeMarking(const std::string& graph)
+{
+    for (unsigned threads : { 1, 2, 4, 8 }) {
+        setMarkThreads(threads);
+        collectGarbage();
+        double before = heapStats().markSeconds;
+        for (int i = 0; i < runs; ++i) collectGarbage();
+        double seconds = (heapStats().markSeconds - before) / runs;
+        std::ostringstream name;
+        name << graph << ", " << threads
+             << (threads == 1 ? " thread" : " threads");
+        report(name.str(), seconds * 1e3, "ms");
+    }
+}
+
+} // end namespace
+
+int main(int argc, char **argv)
+{
+    long scale = argc > 1 ? std::atol(argv[1]) : 1000;
+    auto env = standardEnvironment();
+    std::istringstream program(
+        "(define build (lambda (n acc)"
+        "  (if (= n 0) acc (build (- n 1) (cons n acc)))))"
+        "(define lists (lambda (n length acc)"
+        "  (if (= n 0) acc"
+        "    (lists (- n 1) length (cons (build length (quote ())) acc)))))"
+        "(define tree (lambda (depth)"
+        "  (if (= depth 0) (lambda () 1)"
+        "    (begin"
+        "      (define left (tree (- depth 1)))"
+        "      (define right (tree (- depth 1)))"
+        "      (lambda () (+ (left) (right)))))))");
+    evalStream(program, env);
+
+    std::ostringstream lists;
+    lists << "(define graph (lists " << scale << " 1000 (quote ())))";
+    eval(parse(lists.str()), env);
+    report("objects in lists", heapStats().objects);
+    timeMarking("lists");
+
+    int depth = 1;
+    while ((2L << depth) < scale * 250) ++depth;
+    std::ostringstream tree;
+    tree << "(define graph (tree " << depth << "))";
+    eval(parse(tree.str()), env);
+    collectGarbage();
+    report("objects in closures", heapStats().objects);
+    timeMarking("closures");
+
+    eval(parse("(define graph (quote ()))"), env);
+    std::vector<SchemeExpr> roots;
+    for (long i = 0; i < scale * 1000; ++i) {
+        roots.push_back(SchemeExpr(std::to_string(i)));
+    }
+    collectGarbage();
+    report("objects in roots", heapStats().objects);
+    timeMarking("roots");
+
+    setMarkThreads(0);
+}
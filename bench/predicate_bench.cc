@@ -0,0 +1,64 @@
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include "bench.hh"
+#include "builtins.hh"
+#include "eval.hh"
+#include "parser.hh"
+
+// Measures type predicates over a list of mixed values, on each
+// evaluator: numbers, characters, strings, symbols, short lists and a
+// list of a thousand elements, so that most tests answer false. null?
+// has always been a plain comparison, so it shows what the walk and
+// the call cost by themselves. Each time is the fastest of a few runs.
+
+namespace {
+
+const int runs = 5;
+
+double secondsFor(const std::string& call, const EnvPointer& env)
+{
+    auto expr = parse(call);
+    double fastest = secondsToRun([&] { eval(expr, env); });
+    for (int i = 1; i < runs; ++i) {
+        fastest = std::min(fastest, secondsToRun([&] { eval(expr, env); }));
+    }
+    return fastest;
+}
+
+} // end namespace
+
+int main(int argc, char **argv)
+{
+    long n = argc > 1 ? std::atol(argv[1]) : 2000;
+    const int values = 12;
+
+    for (auto mode : { EvalMode::Tree, EvalMode::Bytecode }) {
+        setEvalMode(mode);
+        auto env = standardEnvironment();
+        std::istringstream program(
+            "(define iota (lambda (n acc)"
+            "  (if (= n 0) acc (iota (- n 1) (cons n acc)))))"
+            "(define values (quasiquote (1 #\\a \"one\" one (1 2)"
+            "  (unquote (iota 1000 (quote ()))) 2 #\\b \"two\" two #t ())))"
+            "(define walk (lambda (test xs count)"
+            "  (if (null? xs) count"
+            "    (walk test (cdr xs) (if (test (car xs)) (+ count 1) count)))))"
+            "(define repeat (lambda (test n)"
+            "  (if (= n 0) 0 (begin (walk test values 0)"
+            "                       (repeat test (- n 1))))))");
+        evalStream(program, env);
+
+        std::string evaluator = mode == EvalMode::Tree ? "tree" : "vm";
+        std::ostringstream count;
+        count << " " << n << ")";
+        for (auto test : { "null?", "number?", "cons?", "string?",
+                           "symbol?" }) {
+            std::string call = std::string("(repeat ") + test + count.str();
+            double seconds = secondsFor(call, env);
+            report(evaluator + ", " + test, seconds * 1e9 / (n * values),
+                   "ns/test");
+        }
+    }
+}
@@ -0,0 +1,35 @@
+#include <cstdlib>
+#include "bench.hh"
+#include "builtins.hh"
+#include "parser.hh"
+
+// Measures what it costs to get an interpreter going: the first
+// standard environment, which is where any one-off setup happens, then
+// each one made after it, and an eval() in a fresh standard
+// environment, as eval(e) without an environment does.
+
+int main(int argc, char **argv)
+{
+    long n = argc > 1 ? std::atol(argv[1]) : 100000;
+    long checksum = 0;
+
+    double seconds = secondsToRun([&] {
+        checksum += standardEnvironment().get() != nullptr;
+    });
+    report("first standard environment", seconds * 1e6, "us");
+
+    seconds = secondsToRun([&] {
+        for (long i = 0; i < n; ++i) {
+            checksum += standardEnvironment().get() != nullptr;
+        }
+    });
+    report("standard environment", seconds * 1e6 / n, "us");
+
+    auto expr = parse("(+ 1 2)");
+    seconds = secondsToRun([&] {
+        for (long i = 0; i < n; ++i) checksum += intValue(eval(expr));
+    });
+    report("eval (+ 1 2) in a new environment", seconds * 1e6 / n, "us");
+
+    return checksum == 0;
+}
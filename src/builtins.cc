@@ -1,27 +1,28 @@
-#include <algorithm>
-#include <cstdlib>   // for std::abs
-#include <numeric>   // for std::accumulate
-#include <boost/variant.hpp>
+#include <cstdlib>      // for std::abs
+#include <functional>   // for std::less and friends
+#include <numeric>      // for std::accumulate
 #include "builtins.hh"
 #include "eval.hh"
+#include "gc.hh"
 #include "scheme_types.hh"
 
+// Primitives that take a fixed number of arguments are typed: they are
+// registered with SCHEME_TYPED, which counts and unboxes the arguments
+// for them. The variadic ones take the arguments as passed.
+
 namespace scheme {
 
-SchemeExpr abs(const SchemeArgs& args)
+int abs(int n)
 {
-    if (args.size() != 1) {
-        std::ostringstream error;
-        error << "abs requires one argument, passed " << args.size();
-        throw scheme_error(error);
-    } else return std::abs(intValue(args.front()));
+    return std::abs(n);
 }
 
 SchemeExpr add(const SchemeArgs& args)
 {
-    std::vector<int> ints(args.size());
-    std::transform(args.begin(), args.end(), ints.begin(), intValue);
-    return std::accumulate(ints.begin(), ints.end(), 0);
+    return std::accumulate(args.begin(), args.end(), 0,
+                           [](int sum, const SchemeExpr& e) {
+                               return sum + intValue(e);
+                           });
 }
 
 SchemeExpr sub(const SchemeArgs& args)
@@ -31,52 +32,48 @@ SchemeExpr sub(const SchemeArgs& args)
     } else if (args.size() == 1) {
         return -intValue(args.front());
     } else {
-        std::vector<int> ints(args.size());
-        std::transform(args.begin(), args.end(), ints.begin(), intValue);
-        return std::accumulate(ints.begin() + 1, ints.end(), ints.front(),
-                               std::minus<int>());
+        return std::accumulate(args.begin() + 1, args.end(),
+                               intValue(args.front()),
+                               [](int difference, const SchemeExpr& e) {
+                                   return difference - intValue(e);
+                               });
     }
 }
 
 SchemeExpr mul(const SchemeArgs& args)
 {
-    std::vector<int> ints(args.size());
-    std::transform(args.begin(), args.end(), ints.begin(), intValue);
-    return std::accumulate(ints.begin(), ints.end(), 1,
-                           std::multiplies<int>());
+    return std::accumulate(args.begin(), args.end(), 1,
+                           [](int product, const SchemeExpr& e) {
+                               return product * intValue(e);
+                           });
 }
 
-SchemeExpr car(const SchemeArgs& args)
+SchemeExpr car(SchemeCons *pair)
 {
-    if (args.size() != 1) {
-        std::ostringstream error;
-        error << "car requires one argument, passed " << args.size();
-        throw scheme_error(error);
-    } else {
-        return ::car(consValue(args.front()));
-    }
+    return ::car(pair);
 }
 
-SchemeExpr cdr(const SchemeArgs& args)
+SchemeExpr cdr(SchemeCons *pair)
 {
-    if (args.size() != 1) {
-        std::ostringstream error;
-        error << "cdr requires one argument, passed " << args.size();
-        throw scheme_error(error);
-    } else {
-        return ::cdr(consValue(args.front()));
-    }
+    return ::cdr(pair);
 }
 
-SchemeExpr cons(const SchemeArgs& args)
+SchemeExpr cons(const SchemeExpr& car, const SchemeExpr& cdr)
 {
-    if (args.size() != 2) {
-        std::ostringstream error;
-        error << "cons requires two arguments, passed " << args.size();
-        throw scheme_error(error);
-    } else {
-        return SchemeCons{ args[0], args[1] };
-    }
+    return ::cons(car, cdr);
+}
+
+// set-car! and set-cdr! return #f rather than the pair, like display.
+SchemeExpr setCar(const SchemeExpr& pair, const SchemeExpr& value)
+{
+    ::setCar(consValue(pair), value);
+    return false;
+}
+
+SchemeExpr setCdr(const SchemeExpr& pair, const SchemeExpr& value)
+{
+    ::setCdr(consValue(pair), value);
+    return false;
 }
 
 SchemeExpr append(const SchemeArgs& args)
@@ -86,17 +83,30 @@ SchemeExpr append(const SchemeArgs& args)
                                 SchemeExpr(Nil::Nil), ::append);
 }
 
-SchemeExpr length(const SchemeArgs& args)
+int length(const SchemeExpr& list)
 {
-    if (args.size() != 1) {
-        std::ostringstream error;
-        error << "length requires one argument, passed " << args.size();
-        throw scheme_error(error);
-    } else {
-        return static_cast<int>(vectorFromExpr(args.front()).size());
+    return static_cast<int>(listLength(list));
+}
+
+namespace {
+
+// Whether compare holds between each argument and the next. Every
+// argument is checked to be an integer, even once the answer is known.
+template <typename Compare>
+bool isChain(const SchemeArgs& args, Compare compare)
+{
+    bool holds = true;
+    int previous = intValue(args.front());
+    for (auto arg = args.begin() + 1; arg != args.end(); ++arg) {
+        int current = intValue(*arg);
+        holds = holds && compare(previous, current);
+        previous = current;
     }
+    return holds;
 }
 
+} // end namespace
+
 SchemeExpr lesser(const SchemeArgs& args)
 {
     if (args.size() < 2) {
@@ -104,10 +114,7 @@ SchemeExpr lesser(const SchemeArgs& args)
         error << "< requires at least two arguments, passed " << args.size();
         throw scheme_error(error);
     } else {
-        std::vector<int> ints(args.size());
-        std::transform(args.begin(), args.end(), ints.begin(), intValue);
-        return std::adjacent_find(ints.begin(), ints.end(),
-                                  std::greater_equal<int>()) == ints.end();
+        return isChain(args, std::less<int>());
     }
 }
 
@@ -118,10 +125,7 @@ SchemeExpr equal(const SchemeArgs& args)
         error << "= requires at least two arguments, passed " << args.size();
         throw scheme_error(error);
     } else {
-        std::vector<int> ints(args.size());
-        std::transform(args.begin(), args.end(), ints.begin(), intValue);
-        return std::adjacent_find(ints.begin(), ints.end(),
-                                  std::not_equal_to<int>()) == ints.end();
+        return isChain(args, std::equal_to<int>());
     }
 }
 
@@ -132,263 +136,265 @@ SchemeExpr greater(const SchemeArgs& args)
         error << "> requires at least two arguments, passed " << args.size();
         throw scheme_error(error);
     } else {
-        std::vector<int> ints(args.size());
-        std::transform(args.begin(), args.end(), ints.begin(), intValue);
-        return std::adjacent_find(ints.begin(), ints.end(),
-                                  std::less_equal<int>()) == ints.end();
+        return isChain(args, std::greater<int>());
     }
 }
 
-SchemeExpr _not(const SchemeArgs& args)
+bool _not(bool b)
 {
-    if (args.size() != 1) {
-        std::ostringstream error;
-        error << "not requires one argument, passed " << args.size();
-        throw scheme_error(error);
-    } else {
-        if (boolValue(args.front())) {
-            return false;
-        } else {
-            return true;
-        }
-    }
+    return !b;
 }
 
-SchemeExpr eq(const SchemeArgs& args)
+bool eq(const SchemeSymbol& x, const SchemeSymbol& y)
 {
-    if (args.size() != 2) {
-        std::ostringstream error;
-        error << "eq? requires two arguments, passed " << args.size();
-        throw scheme_error(error);
-    } else {
-        return symbolValue(args[0]) == symbolValue(args[1]);
-    }
+    return &x == &y;
 }
 
-SchemeExpr equalp(const SchemeArgs& args)
+bool equalp(const SchemeExpr& x, const SchemeExpr& y)
 {
-    if (args.size() != 2) {
-        std::ostringstream error;
-        error << "equal? requires two arguments, passed " << args.size();
-        throw scheme_error(error);
-    } else {
-        return args[0] == args[1];
-    }
+    return x == y;
 }
 
-SchemeExpr stringLength(const SchemeArgs& args)
+int stringLength(const std::string& string)
 {
-    if (args.size() != 1) {
-        std::ostringstream error;
-        error << "string-length requires one argument, passed " << args.size();
-        throw scheme_error(error);
-    } else {
-        return static_cast<int>(stringValue(args.front()).length());
-    }
+    return static_cast<int>(string.length());
 }
 
-SchemeExpr stringRef(const SchemeArgs& args)
+char stringRef(const std::string& string, int i)
 {
-    if (args.size() != 2) {
+    auto index = static_cast<std::size_t>(i);
+    if (index >= string.length()) {
         std::ostringstream error;
-        error << "string-ref requires two arguments, passed " << args.size();
+        error << "Index " << index << " out of bounds for " << string;
         throw scheme_error(error);
     } else {
-        auto string = stringValue(args[0]);
-        auto index  = static_cast<std::size_t>(intValue(args[1]));
-        if (index >= string.length()) {
-            std::ostringstream error;
-            error << "Index " << index << " out of bounds for " << string;
-            throw scheme_error(error);
-        } else {
-            return string[index];
-        }
+        return string[index];
     }
 }
 
-SchemeExpr display(const SchemeArgs& args)
+SchemeExpr display(const SchemeExpr& value)
 {
-    if (args.size() != 1) {
-        std::ostringstream error;
-        error << "display requires one argument, passed " << args.size();
-        throw scheme_error(error);
+    if (value.isString()) {
+        std::cout << asString(value);
     } else {
-        try {
-            std::cout << boost::get<std::string>(args.front());
-        } catch (const boost::bad_get&) {
-            std::cout << args.front();
-        }
-        return false;
+        std::cout << value;
     }
+    return false;
 }
 
-SchemeExpr newline(const SchemeArgs& args)
+SchemeExpr newline()
 {
-    if (!args.empty()) {
-        std::ostringstream error;
-        error << "newline does not take arguments, passed " << args.size();
-        throw scheme_error(error);
-    } else {
-        std::cout << std::endl;
-        return false;
-    }
+    std::cout << std::endl;
+    return false;
 }
 
-SchemeExpr characterp(const SchemeArgs& args)
+int gc()
 {
-    if (args.size() != 1) {
-        std::ostringstream error;
-        error << "character? requires one argument, passed " << args.size();
-        throw scheme_error(error);
-    } else {
-        try {
-            charValue(args.front());
-            return true;
-        } catch (const scheme_error&) {
-            return false;
-        }
-    }
+    return static_cast<int>(collectGarbage());
 }
 
-SchemeExpr consp(const SchemeArgs& args)
+// (with-region thunk): calls thunk with what it allocates in a Region,
+// returning its result.
+SchemeExpr withRegion(SchemeFunction *thunk)
 {
-    if (args.size() != 1) {
-        std::ostringstream error;
-        error << "cons? requires one argument, passed " << args.size();
-        throw scheme_error(error);
-    } else {
-        try {
-            consValue(args.front());
-            return true;
-        } catch (const scheme_error&) {
-            return false;
-        }
+    SchemeExpr result;
+    {
+        Region region;
+        result = (*thunk)(SchemeArgs(nullptr, 0));
     }
+    return result;
 }
 
-SchemeExpr nullp(const SchemeArgs& args)
+// (objects bytes collections minor-collections): the objects and bytes
+// on the heap, and how many times all of it and just its nursery have
+// been collected.
+SchemeExpr heapStatsList()
 {
-    if (args.size() != 1) {
-        std::ostringstream error;
-        error << "null? requires one argument, passed " << args.size();
-        throw scheme_error(error);
-    } else {
-        return SchemeExpr(Nil::Nil) == args.front();
-    }
+    auto stats = heapStats();
+    SchemeExpr counts[] = { static_cast<int>(stats.objects),
+                            static_cast<int>(stats.bytes),
+                            static_cast<int>(stats.collections),
+                            static_cast<int>(stats.minorCollections) };
+    return consFromVector(SchemeArgs(counts, 4));
 }
 
-SchemeExpr numberp(const SchemeArgs& args)
+// (median 90th 99th longest): percentiles of the recent collection
+// pauses, and the longest so far, in microseconds.
+SchemeExpr pauseStats()
 {
-    if (args.size() != 1) {
-        std::ostringstream error;
-        error << "number? requires one argument, passed " << args.size();
-        throw scheme_error(error);
-    } else {
-        try {
-            intValue(args.front());
-            return true;
-        } catch (const scheme_error&) {
-            return false;
-        }
-    }
+    auto stats = heapStats();
+    auto micros = [](double seconds) {
+        return static_cast<int>(seconds * 1e6);
+    };
+    SchemeExpr pauses[] = { micros(stats.medianPauseSeconds),
+                            micros(stats.pause90Seconds),
+                            micros(stats.pause99Seconds),
+                            micros(stats.longestPauseSeconds) };
+    return consFromVector(SchemeArgs(pauses, 4));
 }
 
-SchemeExpr stringp(const SchemeArgs& args)
+// ((size allocations recycled chunks) ...): for each pool that small
+// objects have been allocated from, the size of its objects, how many
+// have been allocated, how many of those reused freed memory, and how
+// many chunks it has taken from the system.
+SchemeExpr poolStatsList()
 {
-    if (args.size() != 1) {
-        std::ostringstream error;
-        error << "string? requires one argument, passed " << args.size();
-        throw scheme_error(error);
-    } else {
-        try {
-            stringValue(args.front());
-            return true;
-        } catch (const scheme_error&) {
-            return false;
-        }
+    std::vector<SchemeExpr> pools;
+    for (const auto& pool : poolStats()) {
+        SchemeExpr counts[] = { static_cast<int>(pool.size),
+                                static_cast<int>(pool.allocations),
+                                static_cast<int>(pool.recycled),
+                                static_cast<int>(pool.chunks) };
+        pools.push_back(consFromVector(SchemeArgs(counts, 4)));
     }
+    return pools.empty() ? SchemeExpr(Nil::Nil) : consFromVector(pools);
 }
 
-SchemeExpr symbolp(const SchemeArgs& args)
+bool characterp(const SchemeExpr& e)
 {
-    if (args.size() != 1) {
-        std::ostringstream error;
-        error << "symbol? requires one argument, passed " << args.size();
-        throw scheme_error(error);
-    } else {
-        try {
-            symbolValue(args.front());
-            return true;
-        } catch (const scheme_error&) {
-            return false;
-        }
-    }
+    return e.isCharacter();
 }
 
-SchemeExpr listToString(const SchemeArgs& args)
+bool consp(const SchemeExpr& e)
 {
-    if (args.size() != 1) {
-        std::ostringstream error;
-        error << "list->string requires one argument, passed " << args.size();
-        throw scheme_error(error);
-    } else {
-        std::vector<SchemeExpr> vec = vectorFromExpr(args.front());
-        std::string string;
-        std::transform(vec.begin(), vec.end(),
-                       back_inserter(string), charValue);
-        return string;
+    return e.isCons();
+}
+
+bool nullp(const SchemeExpr& e)
+{
+    return e.isNil();
+}
+
+bool numberp(const SchemeExpr& e)
+{
+    return e.isFixnum();
+}
+
+bool stringp(const SchemeExpr& e)
+{
+    return e.isString();
+}
+
+bool symbolp(const SchemeExpr& e)
+{
+    return e.isSymbol();
+}
+
+const SchemeSymbol *stringToSymbol(const std::string& name)
+{
+    return intern(name);
+}
+
+std::string symbolToString(const SchemeSymbol& symbol)
+{
+    return symbol.string;
+}
+
+std::string listToString(const SchemeExpr& list)
+{
+    std::string string;
+    string.reserve(listLength(list));
+    for (const ExprWord *rest = &list; !rest->isNil();
+         rest = &::cdr(asCons(*rest))) {
+        string += charValue(::car(asCons(*rest)));
     }
+    return string;
+}
+
+} // end namespace
+
+namespace {
+
+// An entry in the table of primitives the standard environment starts
+// with. primitive() makes one from a variadic function, or from the
+// TypedPrimitive SCHEME_TYPED makes for a typed one.
+struct PrimitiveEntry {
+    const char *name;
+    std::size_t arity;
+    PrimitiveFunction::Variadic variadic;
+    PrimitiveFunction::Fixed fixed;
+};
+
+constexpr PrimitiveEntry primitive(const char *name,
+                                   PrimitiveFunction::Variadic function)
+{
+    return { name, PrimitiveFunction::variadic, function, nullptr };
+}
+
+template <typename Signature, Signature *function>
+constexpr PrimitiveEntry primitive(const char *name,
+                                   TypedPrimitive<Signature, function>)
+{
+    return { name, TypedPrimitive<Signature, function>::arity, nullptr,
+             &TypedPrimitive<Signature, function>::call };
+}
+
+constexpr PrimitiveEntry primitives[] = {
+    primitive("+", scheme::add),
+    primitive("-", scheme::sub),
+    primitive("*", scheme::mul),
+    primitive("<", scheme::lesser),
+    primitive(">", scheme::greater),
+    primitive("=", scheme::equal),
+    primitive("abs", SCHEME_TYPED(scheme::abs)),
+    primitive("append", scheme::append),
+    primitive("car", SCHEME_TYPED(scheme::car)),
+    primitive("character?", SCHEME_TYPED(scheme::characterp)),
+    primitive("cdr", SCHEME_TYPED(scheme::cdr)),
+    primitive("cons", SCHEME_TYPED(scheme::cons)),
+    primitive("cons?", SCHEME_TYPED(scheme::consp)),
+    primitive("display", SCHEME_TYPED(scheme::display)),
+    primitive("eq?", SCHEME_TYPED(scheme::eq)),
+    primitive("equal?", SCHEME_TYPED(scheme::equalp)),
+    primitive("gc", SCHEME_TYPED(scheme::gc)),
+    primitive("heap-stats", SCHEME_TYPED(scheme::heapStatsList)),
+    primitive("length", SCHEME_TYPED(scheme::length)),
+    primitive("list->string", SCHEME_TYPED(scheme::listToString)),
+    primitive("newline", SCHEME_TYPED(scheme::newline)),
+    primitive("not", SCHEME_TYPED(scheme::_not)),
+    primitive("null?", SCHEME_TYPED(scheme::nullp)),
+    primitive("number?", SCHEME_TYPED(scheme::numberp)),
+    primitive("pause-stats", SCHEME_TYPED(scheme::pauseStats)),
+    primitive("pool-stats", SCHEME_TYPED(scheme::poolStatsList)),
+    primitive("set-car!", SCHEME_TYPED(scheme::setCar)),
+    primitive("set-cdr!", SCHEME_TYPED(scheme::setCdr)),
+    primitive("string?", SCHEME_TYPED(scheme::stringp)),
+    primitive("string-length", SCHEME_TYPED(scheme::stringLength)),
+    primitive("string-ref", SCHEME_TYPED(scheme::stringRef)),
+    primitive("string->symbol", SCHEME_TYPED(scheme::stringToSymbol)),
+    primitive("symbol?", SCHEME_TYPED(scheme::symbolp)),
+    primitive("symbol->string", SCHEME_TYPED(scheme::symbolToString)),
+    primitive("with-region", SCHEME_TYPED(scheme::withRegion)),
+};
+
+// The environment every standard environment copies its definitions
+// from. It is made the first time it's needed and never changed
+// afterwards; the program only ever sees copies of it. Like a symbol,
+// it holds a root on itself that is never released.
+const SchemeEnvironment& baseEnvironment()
+{
+    static const SchemeEnvironment *base = [] {
+        auto env = new SchemeEnvironment;
+        ++env->rootCount;
+        for (const auto& entry : primitives) {
+            auto function = entry.fixed
+                ? new PrimitiveFunction(entry.name, entry.arity, entry.fixed)
+                : new PrimitiveFunction(entry.name, entry.variadic);
+            env->define(*intern(entry.name), function);
+        }
+        return env;
+    }();
+    return *base;
 }
 
 } // end namespace
 
 SchemeExpr eval(const SchemeExpr& e)
 {
-    return boost::apply_visitor(evalVisitor(standardEnvironment()), e);
-}
-
-inline void addPrimitive(std::vector<SchemeSymbol>& names,
-                         std::vector<SchemeExpr>& functions,
-                         const std::string& name,
-                         SchemeExpr (*function)(const SchemeArgs&))
-{
-    auto primitive = SchemeExpr(std::make_shared<PrimitiveFunction>(function));
-    names.push_back(symbolValue(parse(name)));
-    functions.push_back(primitive);
-}
-
-std::shared_ptr<SchemeEnvironment> standardEnvironment()
-{
-    std::vector<SchemeSymbol> names;
-    std::vector<SchemeExpr> functions;
-
-    addPrimitive(names, functions, "+", scheme::add);
-    addPrimitive(names, functions, "-", scheme::sub);
-    addPrimitive(names, functions, "*", scheme::mul);
-    addPrimitive(names, functions, "<", scheme::lesser);
-    addPrimitive(names, functions, ">", scheme::greater);
-    addPrimitive(names, functions, "=", scheme::equal);
-    addPrimitive(names, functions, "abs", scheme::abs);
-    addPrimitive(names, functions, "append", scheme::append);
-    addPrimitive(names, functions, "car", scheme::car);
-    addPrimitive(names, functions, "character?", scheme::characterp);
-    addPrimitive(names, functions, "cdr", scheme::cdr);
-    addPrimitive(names, functions, "cons", scheme::cons);
-    addPrimitive(names, functions, "cons?", scheme::consp);
-    addPrimitive(names, functions, "display", scheme::display);
-    addPrimitive(names, functions, "eq?", scheme::eq);
-    addPrimitive(names, functions, "equal?", scheme::equalp);
-    addPrimitive(names, functions, "length", scheme::length);
-    addPrimitive(names, functions, "list->string", scheme::listToString);
-    addPrimitive(names, functions, "newline", scheme::newline);
-    addPrimitive(names, functions, "not", scheme::_not);
-    addPrimitive(names, functions, "null?", scheme::nullp);
-    addPrimitive(names, functions, "number?", scheme::numberp);
-    addPrimitive(names, functions, "string?", scheme::stringp);
-    addPrimitive(names, functions, "string-length", scheme::stringLength);
-    addPrimitive(names, functions, "string-ref", scheme::stringRef);
-    addPrimitive(names, functions, "symbol?", scheme::symbolp);
-
-    return std::make_shared<SchemeEnvironment>(
-        SchemeEnvironment(names, functions));
+    return eval(e, standardEnvironment());
+}
+
+EnvPointer standardEnvironment()
+{
+    return makeHandle<SchemeEnvironment>(baseEnvironment());
 }
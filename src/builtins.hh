@@ -3,7 +3,7 @@
 
 #include "scheme_types.hh"
 
-std::shared_ptr<SchemeEnvironment> standardEnvironment();
+EnvPointer standardEnvironment();
 SchemeExpr eval(const SchemeExpr& e); // evaluate in standard environment
 
 #endif
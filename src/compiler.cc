@@ -0,0 +1,338 @@
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include "compiler.hh"
+#include "parser.hh"
+#include "scheme_types.hh"
+#include "syntax.hh"
+
+namespace {
+
+const char *const opcodeNames[] = {
+#define SCHEME_OPCODE_NAME(name, operands) #name,
+    SCHEME_OPCODES(SCHEME_OPCODE_NAME)
+#undef SCHEME_OPCODE_NAME
+};
+
+const std::size_t operandCounts[] = {
+#define SCHEME_OPCODE_OPERANDS(name, operands) operands,
+    SCHEME_OPCODES(SCHEME_OPCODE_OPERANDS)
+#undef SCHEME_OPCODE_OPERANDS
+};
+
+std::uint16_t operand(std::size_t n)
+{
+    if (n > 0xffff) throw scheme_error("Expression too large to compile");
+    return static_cast<std::uint16_t>(n);
+}
+
+// Compiles expressions into one Code object, in the given scope.
+class Compiler {
+    Code& code;
+    Scope *scope;
+
+public:
+    Compiler(Code& code, Scope *scope) : code(code), scope(scope) {}
+
+    // An expression in tail position is the last thing its function
+    // does, so a call there can replace the function's own frame.
+    void compile(const SchemeExpr& e, bool tail = false);
+
+private:
+    void emit(Opcode op) {
+        code.instructions.push_back(static_cast<std::uint16_t>(op));
+    }
+
+    void emit(Opcode op, std::size_t a) {
+        emit(op);
+        code.instructions.push_back(operand(a));
+    }
+
+    void emit(Opcode op, std::size_t a, std::size_t b) {
+        emit(op, a);
+        code.instructions.push_back(operand(b));
+    }
+
+    void emit(Opcode op, std::size_t a, std::size_t b, std::size_t c) {
+        emit(op, a, b);
+        code.instructions.push_back(operand(c));
+    }
+
+    // Emits a jump whose target is filled in later by patch().
+    std::size_t emitJump(Opcode op) {
+        emit(op, 0);
+        return code.instructions.size() - 1;
+    }
+
+    void patch(std::size_t jump) {
+        code.instructions[jump] = operand(code.instructions.size());
+    }
+
+    std::size_t constant(const SchemeExpr& e) {
+        auto& constants = code.constants;
+        for (std::size_t i = 0; i < constants.size(); ++i) {
+            if (constants[i].raw() == e.raw()) return i;
+        }
+        constants.push_back(e);
+        return constants.size() - 1;
+    }
+
+    void compileVariable(const SchemeSymbol& symbol);
+    void compileList(const SchemeCons *cons, bool tail);
+    void compileBody(SchemeArgs::const_iterator begin,
+                     SchemeArgs::const_iterator end, bool tail);
+    void compileDefine(const SchemeArgs& args);
+    void compileSet(const SchemeArgs& args);
+    void compileIf(const SchemeArgs& args, bool tail);
+    void compileLambda(const SchemeArgs& args);
+    void compileShortCircuit(const SchemeArgs& args, Opcode jump,
+                             bool emptyValue, bool tail);
+    void compileQuasiquoted(const SchemeExpr& e);
+    void compileCall(const SchemeCons *cons, const SchemeArgs& args,
+                     bool tail);
+};
+
+void Compiler::compile(const SchemeExpr& e, bool tail)
+{
+    if (e.isSymbol()) {
+        compileVariable(asSymbol(e));
+    } else if (e.isCons()) {
+        compileList(asCons(e), tail);
+    } else if (e.isNil()) {
+        throw scheme_error("Missing function in ()");
+    } else {
+        emit(Opcode::Constant, constant(e));
+    }
+}
+
+void Compiler::compileVariable(const SchemeSymbol& symbol)
+{
+    auto address = resolve(symbol, scope);
+    if (address.global) {
+        emit(Opcode::GlobalRef, address.depth, constant(&symbol));
+    } else {
+        emit(Opcode::LocalRef, address.depth, address.slot,
+             constant(&symbol));
+    }
+}
+
+void Compiler::compileList(const SchemeCons *cons, bool tail)
+{
+    auto operands = vectorFromExpr(cdr(cons));
+    SchemeArgs args(operands);
+    switch (keywordOf(car(cons))) {
+    case Keyword::And:
+        return compileShortCircuit(args, Opcode::JumpIfFalseOrPop, true,
+                                   tail);
+    case Keyword::Begin:
+        if (args.empty()) throw scheme_error("Empty begin form");
+        return compileBody(args.begin(), args.end(), tail);
+    case Keyword::If:         return compileIf(args, tail);
+    case Keyword::Define:     return compileDefine(args);
+    case Keyword::Lambda:     return compileLambda(args);
+    case Keyword::Quasiquote:
+        requireArgs("quasiquote", args, 1);
+        return compileQuasiquoted(args.front());
+    case Keyword::Quote:
+        requireArgs("quote", args, 1);
+        return emit(Opcode::Constant, constant(args.front()));
+    case Keyword::Or:
+        return compileShortCircuit(args, Opcode::JumpIfTrueOrPop, false,
+                                   tail);
+    case Keyword::Set:        return compileSet(args);
+    case Keyword::Unquote:
+        throw scheme_error("unquote outside of quasiquote");
+    case Keyword::UnquoteSplicing:
+        throw scheme_error ("unquote-splicing outside of quasiquote");
+    case Keyword::None:
+        break;
+    }
+    compileCall(cons, args, tail);
+}
+
+void Compiler::compileBody(SchemeArgs::const_iterator begin,
+                           SchemeArgs::const_iterator end, bool tail)
+{
+    for (auto it = begin; it != end; ++it) {
+        if (it != begin) emit(Opcode::Pop);
+        compile(*it, tail && it + 1 == end);
+    }
+}
+
+void Compiler::compileDefine(const SchemeArgs& args)
+{
+    requireArgs("define", args, 2);
+    const auto& symbol = symbolValue(args[0]);
+    if (scope) {
+        auto slot = scope->declare(&symbol);
+        compile(args[1]);
+        emit(Opcode::LocalDefine, slot, constant(&symbol));
+    } else {
+        compile(args[1]);
+        emit(Opcode::GlobalDefine, constant(&symbol));
+    }
+}
+
+void Compiler::compileSet(const SchemeArgs& args)
+{
+    requireArgs("set!", args, 2);
+    const auto& symbol = symbolValue(args[0]);
+    auto address = resolve(symbol, scope);
+    compile(args[1]);
+    if (address.global) {
+        emit(Opcode::GlobalSet, address.depth, constant(&symbol));
+    } else {
+        emit(Opcode::LocalSet, address.depth, address.slot,
+             constant(&symbol));
+    }
+}
+
+void Compiler::compileIf(const SchemeArgs& args, bool tail)
+{
+    requireArgs("if", args, 3);
+    compile(args[0]);
+    auto toAlternative = emitJump(Opcode::JumpIfFalse);
+    compile(args[1], tail);
+    auto toEnd = emitJump(Opcode::Jump);
+    patch(toAlternative);
+    compile(args[2], tail);
+    patch(toEnd);
+}
+
+void Compiler::compileLambda(const SchemeArgs& args)
+{
+    auto lambdaList = parseLambdaList(args);
+    Scope bodyScope(lambdaList.params, scope);
+    for (auto it = args.begin() + 1; it != args.end(); ++it) {
+        declareDefinitions(*it, bodyScope);
+    }
+    if (args.size() == 1) throw scheme_error("Empty begin form");
+
+    auto function = std::make_shared<Code>();
+    Compiler body(*function, &bodyScope);
+    body.compileBody(args.begin() + 1, args.end(), true);
+    body.emit(Opcode::Return);
+    function->paramCount = lambdaList.params.size();
+    function->frameSize = bodyScope.names.size();
+    function->hasRestParam = lambdaList.hasRestParam;
+
+    code.functions.push_back(function);
+    emit(Opcode::MakeClosure, code.functions.size() - 1);
+}
+
+// and and or: each argument but the last either decides the result,
+// leaving it on the stack for the jump to the end, or is popped.
+void Compiler::compileShortCircuit(const SchemeArgs& args, Opcode jump,
+                                   bool emptyValue, bool tail)
+{
+    if (args.empty()) {
+        emit(Opcode::Constant, constant(emptyValue));
+        return;
+    }
+
+    std::vector<std::size_t> toEnd;
+    for (std::size_t i = 0; i + 1 < args.size(); ++i) {
+        compile(args[i]);
+        toEnd.push_back(emitJump(jump));
+    }
+    compile(args.back(), tail);
+    for (auto at : toEnd) patch(at);
+}
+
+void Compiler::compileQuasiquoted(const SchemeExpr& e)
+{
+    if (!e.isCons()) {
+        emit(Opcode::Constant, constant(e));
+        return;
+    }
+
+    auto cons = asCons(e);
+    Keyword keyword = keywordOf(car(cons));
+    if (keyword == Keyword::UnquoteSplicing) {
+        throw scheme_error("Invalid splice in quasiquote");
+    } else if (keyword == Keyword::Unquote) {
+        auto unquoted = vectorFromCons(cons);
+        requireArgs("unquote", SchemeArgs(unquoted.data() + 1,
+                                          unquoted.size() - 1), 1);
+        compile(unquoted[1]);
+    } else if (isSplice(car(cons))) {
+        auto splice = vectorFromCons(asCons(car(cons)));
+        requireArgs("unquote-splicing", SchemeArgs(splice.data() + 1,
+                                                   splice.size() - 1), 1);
+        compile(splice[1]);
+        compileQuasiquoted(cdr(cons));
+        emit(Opcode::Append);
+    } else {
+        compileQuasiquoted(car(cons));
+        compileQuasiquoted(cdr(cons));
+        emit(Opcode::Cons);
+    }
+}
+
+void Compiler::compileCall(const SchemeCons *cons, const SchemeArgs& args,
+                           bool tail)
+{
+    compile(car(cons));
+    for (const auto& arg : args) compile(arg);
+    emit(tail ? Opcode::TailCall : Opcode::Call, args.size());
+}
+
+void disassemble(std::ostream& out, const Code& code, const std::string& name)
+{
+    out << name << ": " << code.paramCount << " parameters";
+    if (code.hasRestParam) out << " (last is &rest)";
+    out << ", frame size " << code.frameSize << "\n";
+
+    const auto& instructions = code.instructions;
+    for (std::size_t pc = 0; pc < instructions.size(); ) {
+        auto op = instructions[pc];
+        std::size_t operands = operandCounts[op];
+        out << std::setw(6) << pc << "  " << std::left
+            << std::setw(operands ? 18 : 0) << opcodeNames[op] << std::right;
+        for (std::size_t i = 1; i <= operands; ++i) {
+            out << " " << instructions[pc + i];
+        }
+        auto last = instructions[pc + operands];
+        switch (static_cast<Opcode>(op)) {
+        case Opcode::Constant:
+        case Opcode::LocalRef:
+        case Opcode::LocalSet:
+        case Opcode::LocalDefine:
+        case Opcode::GlobalRef:
+        case Opcode::GlobalSet:
+        case Opcode::GlobalDefine:
+            out << "\t; " << code.constants[last];
+            break;
+        case Opcode::MakeClosure:
+            out << "\t; " << name << "." << last;
+            break;
+        default:
+            break;
+        }
+        out << "\n";
+        pc += 1 + operands;
+    }
+
+    for (std::size_t i = 0; i < code.functions.size(); ++i) {
+        std::ostringstream nested;
+        nested << name << "." << i;
+        out << "\n";
+        disassemble(out, *code.functions[i], nested.str());
+    }
+}
+
+} // end namespace
+
+CodePointer compile(const SchemeExpr& e)
+{
+    auto code = std::make_shared<Code>();
+    Compiler compiler(*code, nullptr);
+    compiler.compile(e);
+    code->instructions.push_back(static_cast<std::uint16_t>(Opcode::Return));
+    return code;
+}
+
+void disassemble(std::ostream& out, const Code& code)
+{
+    disassemble(out, code, "code");
+}
@@ -0,0 +1,62 @@
+#ifndef COMPILER_HH
+#define COMPILER_HH
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include "scheme_types.hh"
+
+// The bytecode compiler turns an expression into a Code object for the
+// stack machine in vm.cc. An instruction is a 16-bit opcode followed by
+// its 16-bit operands. Variables are resolved to frame addresses exactly
+// as analyze() resolves them, and name operands index the constant pool
+// so errors can still report the symbol.
+//
+// Each entry gives the opcode, its operand count and the operands.
+#define SCHEME_OPCODES(X)                                                 \
+    X(Constant, 1)        /* k: push constants[k] */                      \
+    X(LocalRef, 3)        /* depth slot name */                           \
+    X(LocalSet, 3)        /* depth slot name: pop into slot, push name */ \
+    X(LocalDefine, 2)     /* slot name: pop into slot, push name */       \
+    X(GlobalRef, 2)       /* depth name */                                \
+    X(GlobalSet, 2)       /* depth name: pop into global, push name */    \
+    X(GlobalDefine, 1)    /* name: pop into global, push name */          \
+    X(Pop, 0)                                                             \
+    X(Jump, 1)            /* target */                                    \
+    X(JumpIfFalse, 1)     /* target: pop a boolean, jump if false */      \
+    X(JumpIfFalseOrPop, 1) /* target: jump if top is #f, else pop */      \
+    X(JumpIfTrueOrPop, 1) /* target: jump unless top is #f, else pop */   \
+    X(MakeClosure, 1)     /* f: push a closure over functions[f] */       \
+    X(Call, 1)            /* argc: call the function below the args */    \
+    X(TailCall, 1)        /* argc: call, reusing this function's place */ \
+    X(Cons, 0)            /* pop cdr and car, push the pair */            \
+    X(Append, 0)          /* pop tail and list, push them appended */     \
+    X(Return, 0)
+
+enum class Opcode : std::uint16_t {
+#define SCHEME_OPCODE_ENUM(name, operands) name,
+    SCHEME_OPCODES(SCHEME_OPCODE_ENUM)
+#undef SCHEME_OPCODE_ENUM
+};
+
+struct Code;
+typedef std::shared_ptr<const Code> CodePointer;
+
+// The compiled form of a top-level expression or of a lambda body.
+// Lambdas nested in the body are compiled into functions.
+struct Code {
+    std::vector<std::uint16_t> instructions;
+    std::vector<SchemeExpr> constants;
+    std::vector<CodePointer> functions;
+    std::size_t paramCount = 0;
+    std::size_t frameSize = 0;
+    bool hasRestParam = false;
+};
+
+CodePointer compile(const SchemeExpr& e);
+
+// Writes a listing of code and the functions nested in it to out.
+void disassemble(std::ostream& out, const Code& code);
+
+#endif
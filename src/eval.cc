@@ -1,164 +1,556 @@
+#include <algorithm>
 #include <memory>
 #include <sstream>
+#include "compiler.hh"
 #include "eval.hh"
+#include "gc.hh"
 #include "parser.hh"
 #include "scheme_types.hh"
+#include "syntax.hh"
+#include "vm.hh"
 
-SchemeExpr evalVisitor::evalAnd(const SchemeArgs& args, envPointer env) const
+namespace {
+
+using envPointer = Node::envPointer;
+
+// Nodes
+
+struct Constant : Node {
+    SchemeExpr value;
+
+    Constant(SchemeExpr value) : value(std::move(value)) {}
+
+    SchemeExpr execute(envPointer) const override {
+        return value;
+    }
+};
+
+[[noreturn]] void undefinedSymbol(const SchemeSymbol& symbol)
 {
-    SchemeExpr last = true;
+    std::ostringstream error;
+    error << "Undefined symbol: " << symbol.string;
+    throw scheme_error(error);
+}
+
+// Variables bound by an enclosing lambda are addressed by how many
+// frames out they are and their slot in that frame.
+
+struct LocalVariable : Node {
+    const SchemeSymbol& symbol;
+    std::size_t depth, slot;
+
+    LocalVariable(const SchemeSymbol& symbol, std::size_t depth,
+                  std::size_t slot)
+        : symbol(symbol), depth(depth), slot(slot) {}
+
+    SchemeExpr execute(envPointer env) const override {
+        const HeapExpr& value = env->up(depth)->slot(slot);
+        if (value.isUnbound()) undefinedSymbol(symbol);
+        return value;
+    }
+};
+
+struct LocalDefine : Node {
+    const SchemeSymbol& symbol;
+    std::size_t slot;
+    NodePointer value;
+
+    LocalDefine(const SchemeSymbol& symbol, std::size_t slot,
+                NodePointer value)
+        : symbol(symbol), slot(slot), value(std::move(value)) {}
+
+    SchemeExpr execute(envPointer env) const override {
+        env->setSlot(slot, value->execute(env));
+        return &symbol;
+    }
+};
+
+struct LocalSet : Node {
+    const SchemeSymbol& symbol;
+    std::size_t depth, slot;
+    NodePointer value;
+
+    LocalSet(const SchemeSymbol& symbol, std::size_t depth, std::size_t slot,
+             NodePointer value)
+        : symbol(symbol), depth(depth), slot(slot), value(std::move(value)) {}
+
+    SchemeExpr execute(envPointer env) const override {
+        if (env->up(depth)->slot(slot).isUnbound()) undefinedSymbol(symbol);
+        auto newValue = value->execute(env);
+        env->up(depth)->setSlot(slot, newValue);
+        return &symbol;
+    }
+};
+
+// Anything else is looked up by symbol id in the global environment,
+// which is depth frames out from where the reference appears.
+
+struct GlobalVariable : Node {
+    const SchemeSymbol& symbol;
+    std::size_t depth;
+
+    GlobalVariable(const SchemeSymbol& symbol, std::size_t depth)
+        : symbol(symbol), depth(depth) {}
+
+    SchemeExpr execute(envPointer env) const override {
+        const HeapExpr *value = env->up(depth)->lookup(symbol);
+        if (!value) undefinedSymbol(symbol);
+        return *value;
+    }
+};
+
+struct GlobalDefine : Node {
+    const SchemeSymbol& symbol;
+    NodePointer value;
+
+    GlobalDefine(const SchemeSymbol& symbol, NodePointer value)
+        : symbol(symbol), value(std::move(value)) {}
+
+    SchemeExpr execute(envPointer env) const override {
+        env->define(symbol, value->execute(env));
+        return &symbol;
+    }
+};
+
+struct GlobalSet : Node {
+    const SchemeSymbol& symbol;
+    std::size_t depth;
+    NodePointer value;
+
+    GlobalSet(const SchemeSymbol& symbol, std::size_t depth,
+              NodePointer value)
+        : symbol(symbol), depth(depth), value(std::move(value)) {}
+
+    SchemeExpr execute(envPointer env) const override {
+        if (!env->up(depth)->lookup(symbol)) undefinedSymbol(symbol);
+        auto newValue = value->execute(env);
+        env->up(depth)->define(symbol, newValue);
+        return &symbol;
+    }
+};
+
+struct If : Node {
+    NodePointer test, consequent, alternative;
+
+    If(NodePointer test, NodePointer consequent, NodePointer alternative)
+        : test(std::move(test)), consequent(std::move(consequent)),
+          alternative(std::move(alternative)) {}
+
+    SchemeExpr execute(envPointer env) const override {
+        if (boolValue(test->execute(env))) {
+            return consequent->execute(env);
+        } else {
+            return alternative->execute(env);
+        }
+    }
+
+    SchemeExpr executeTail(envPointer env, TailCall& call) const override {
+        if (boolValue(test->execute(env))) {
+            return consequent->executeTail(env, call);
+        } else {
+            return alternative->executeTail(env, call);
+        }
+    }
+};
+
+struct Begin : Node {
+    std::vector<NodePointer> body;
+
+    Begin(std::vector<NodePointer> body) : body(std::move(body)) {}
+
+    SchemeExpr execute(envPointer env) const override {
+        for (std::size_t i = 0; i + 1 < body.size(); ++i) {
+            body[i]->execute(env);
+        }
+        return body.back()->execute(env);
+    }
+
+    SchemeExpr executeTail(envPointer env, TailCall& call) const override {
+        for (std::size_t i = 0; i + 1 < body.size(); ++i) {
+            body[i]->execute(env);
+        }
+        return body.back()->executeTail(env, call);
+    }
+};
+
+struct Lambda : Node {
+    std::size_t paramCount;
+    std::size_t frameSize;
+    bool hasRestParam;
+    bool hasLambdas;
+    NodePointer body;
+
+    Lambda(std::size_t paramCount, std::size_t frameSize, bool hasRestParam,
+           bool hasLambdas, NodePointer body)
+        : paramCount(paramCount), frameSize(frameSize),
+          hasRestParam(hasRestParam), hasLambdas(hasLambdas),
+          body(std::move(body)) {}
+
+    SchemeExpr execute(envPointer env) const override {
+        return new LexicalFunction(paramCount, frameSize, body, hasRestParam,
+                                   hasLambdas, env);
+    }
+};
+
+struct And : Node {
+    std::vector<NodePointer> args;
+
+    And(std::vector<NodePointer> args) : args(std::move(args)) {}
+
+    SchemeExpr execute(envPointer env) const override {
+        SchemeExpr last = true;
+        for (const auto& arg : args) {
+            last = arg->execute(env);
+            if (last == SchemeExpr(false)) return false;
+        }
+        return last;
+    }
+
+    SchemeExpr executeTail(envPointer env, TailCall& call) const override {
+        if (args.empty()) return true;
+        for (std::size_t i = 0; i + 1 < args.size(); ++i) {
+            if (args[i]->execute(env) == SchemeExpr(false)) return false;
+        }
+        return args.back()->executeTail(env, call);
+    }
+};
+
+struct Or : Node {
+    std::vector<NodePointer> args;
+
+    Or(std::vector<NodePointer> args) : args(std::move(args)) {}
+
+    SchemeExpr execute(envPointer env) const override {
+        for (const auto& arg : args) {
+            auto evalled = arg->execute(env);
+            if (evalled != SchemeExpr(false)) return evalled;
+        }
+        return false;
+    }
+
+    SchemeExpr executeTail(envPointer env, TailCall& call) const override {
+        if (args.empty()) return false;
+        for (std::size_t i = 0; i + 1 < args.size(); ++i) {
+            auto evalled = args[i]->execute(env);
+            if (evalled != SchemeExpr(false)) return evalled;
+        }
+        return args.back()->executeTail(env, call);
+    }
+};
+
+struct Funcall : Node {
+    NodePointer op;
+    std::vector<NodePointer> args;
+
+    Funcall(NodePointer op, std::vector<NodePointer> args)
+        : op(std::move(op)), args(std::move(args)) {}
+
+    SchemeExpr execute(envPointer env) const override {
+        auto function = op->execute(env);
+        ArgBuffer evalledArgs;
+        evalledArgs.reset(args.size());
+        for (std::size_t i = 0; i < args.size(); ++i) {
+            evalledArgs[i] = args[i]->execute(env);
+        }
+        return callFunction(functionPointer(function), evalledArgs.data(),
+                            evalledArgs.size());
+    }
 
-    for (const SchemeExpr& e : args) {
-        auto evalled = eval(e, env);
-        try {
-            if (!boolValue(evalled)) return false;
-            else last = evalled;
-        } catch (const scheme_error&) {
-            last = evalled;
+    SchemeExpr executeTail(envPointer env, TailCall& call) const override {
+        call.function = op->execute(env);
+        functionPointer(call.function);     // check it can be called
+        call.args.reset(args.size());
+        for (std::size_t i = 0; i < args.size(); ++i) {
+            call.args[i] = args[i]->execute(env);
         }
+        call.pending = true;
+        return Nil::Nil;
+    }
+};
+
+// Quasiquote templates are analyzed into a tree mirroring the
+// template, so only the unquoted parts are evaluated at run time.
+
+struct QuasiCons : Node {
+    NodePointer car, cdr;
+
+    QuasiCons(NodePointer car, NodePointer cdr)
+        : car(std::move(car)), cdr(std::move(cdr)) {}
+
+    SchemeExpr execute(envPointer env) const override {
+        auto carVal = car->execute(env);
+        return ::cons(carVal, cdr->execute(env));
+    }
+};
+
+struct QuasiSplice : Node {
+    NodePointer spliced, rest;
+
+    QuasiSplice(NodePointer spliced, NodePointer rest)
+        : spliced(std::move(spliced)), rest(std::move(rest)) {}
+
+    SchemeExpr execute(envPointer env) const override {
+        auto list = spliced->execute(env);
+        return append(list, rest->execute(env));
     }
+};
+
+// Analysis
+
+NodePointer analyze(const SchemeExpr& e, Scope *scope);
 
-    return last;
+std::vector<NodePointer> analyzeAll(SchemeArgs::const_iterator begin,
+                                    SchemeArgs::const_iterator end,
+                                    Scope *scope)
+{
+    std::vector<NodePointer> nodes;
+    nodes.reserve(end - begin);
+    for (auto it = begin; it != end; ++it) {
+        nodes.push_back(analyze(*it, scope));
+    }
+    return nodes;
 }
 
-SchemeExpr
-evalVisitor::evalBegin(const SchemeArgs& args, envPointer env) const
+NodePointer analyzeBegin(SchemeArgs::const_iterator begin,
+                         SchemeArgs::const_iterator end, Scope *scope)
 {
-    if (args.empty()) throw scheme_error("Empty begin form");
+    if (begin == end) throw scheme_error("Empty begin form");
+    if (end - begin == 1) return analyze(*begin, scope);
+    return std::make_shared<Begin>(analyzeAll(begin, end, scope));
+}
 
-    SchemeExpr result;
-    for (const auto& expr : args) {
-        result = eval(expr, env);
+NodePointer analyzeDefine(const SchemeArgs& args, Scope *scope)
+{
+    requireArgs("define", args, 2);
+    const auto& symbol = symbolValue(args[0]);
+    if (scope) {
+        auto slot = scope->declare(&symbol);
+        return std::make_shared<LocalDefine>(symbol, slot,
+                                             analyze(args[1], scope));
+    } else {
+        return std::make_shared<GlobalDefine>(symbol, analyze(args[1], scope));
     }
+}
 
-    return result;
+NodePointer analyzeSet(const SchemeArgs& args, Scope *scope)
+{
+    requireArgs("set!", args, 2);
+    const auto& symbol = symbolValue(args[0]);
+    auto address = resolve(symbol, scope);
+    auto value = analyze(args[1], scope);
+    if (address.global) {
+        return std::make_shared<GlobalSet>(symbol, address.depth, value);
+    } else {
+        return std::make_shared<LocalSet>(symbol, address.depth,
+                                          address.slot, value);
+    }
 }
 
-SchemeExpr
-evalVisitor::evalFuncall(const SchemeExpr& car, const SchemeArgs& args,
-                         envPointer env) const
+NodePointer analyzeIf(const SchemeArgs& args, Scope *scope)
 {
-    auto evalVisitorArg = [env](SchemeExpr e) { return eval(e, env); };
-    SchemeArgs evalledArgs;
-    std::transform(args.begin(), args.end(),
-                   back_inserter(evalledArgs), evalVisitorArg );
-    return (*functionPointer(car))(evalledArgs);
+    requireArgs("if", args, 3);
+    return std::make_shared<If>(analyze(args[0], scope),
+                                analyze(args[1], scope),
+                                analyze(args[2], scope));
 }
 
-SchemeExpr evalVisitor::evalIf(const SchemeArgs& args, envPointer env) const
+NodePointer analyzeLambda(const SchemeArgs& args, Scope *scope)
 {
-    if (args.size() != 3) {
-        std::ostringstream error;
-        error << "if requires exactly 3 arguments, ";
-        error << "passed " << args.size();
-        throw scheme_error(error);
+    if (scope) scope->hasLambdas = true;
+    auto lambdaList = parseLambdaList(args);
+    Scope bodyScope(lambdaList.params, scope);
+    for (auto it = args.begin() + 1; it != args.end(); ++it) {
+        declareDefinitions(*it, bodyScope);
     }
-    auto pred = eval(args[0], env);
-    if (boolValue(pred)) {
-        return eval(args[1], env);
+    auto body = analyzeBegin(args.begin() + 1, args.end(), &bodyScope);
+    return std::make_shared<Lambda>(lambdaList.params.size(),
+                                    bodyScope.names.size(),
+                                    lambdaList.hasRestParam,
+                                    bodyScope.hasLambdas, body);
+}
+
+NodePointer analyzeQuasiquoted(const SchemeExpr& e, Scope *scope)
+{
+    if (!e.isCons()) return std::make_shared<Constant>(e);
+
+    auto cons = asCons(e);
+    Keyword keyword = keywordOf(car(cons));
+    if (keyword == Keyword::UnquoteSplicing) {
+        throw scheme_error("Invalid splice in quasiquote");
+    } else if (keyword == Keyword::Unquote) {
+        auto unquoted = vectorFromCons(cons);
+        requireArgs("unquote", SchemeArgs(unquoted.data() + 1,
+                                          unquoted.size() - 1), 1);
+        return analyze(unquoted[1], scope);
+    } else if (isSplice(car(cons))) {
+        auto splice = vectorFromCons(asCons(car(cons)));
+        requireArgs("unquote-splicing", SchemeArgs(splice.data() + 1,
+                                                   splice.size() - 1), 1);
+        return std::make_shared<QuasiSplice>(
+            analyze(splice[1], scope), analyzeQuasiquoted(cdr(cons), scope));
     } else {
-        return eval(args[2], env);
+        return std::make_shared<QuasiCons>(
+            analyzeQuasiquoted(car(cons), scope),
+            analyzeQuasiquoted(cdr(cons), scope));
     }
 }
 
-SchemeExpr evalVisitor::evalLambda(const SchemeArgs& args, envPointer env) const
+NodePointer analyzeQuasiquote(const SchemeArgs& args, Scope *scope)
 {
-    auto procArgs = vectorFromExpr(args[0]);
-    std::vector<SchemeSymbol> params;
-    bool hasRestParam = false;
+    requireArgs("quasiquote", args, 1);
+    return analyzeQuasiquoted(args.front(), scope);
+}
 
-    for (std::size_t i = 0; i < procArgs.size(); ++i) {
-        if (symbolValue(procArgs[i]).string != "&rest") {
-            params.push_back(symbolValue(procArgs[i]));
-        } else if (i == procArgs.size() - 2) { // only one rest parameter
-            hasRestParam = true;
-            params.push_back(symbolValue(procArgs[i + 1]));
-            break;
+NodePointer analyzeQuote(const SchemeArgs& args)
+{
+    requireArgs("quote", args, 1);
+    return std::make_shared<Constant>(args.front());
+}
+
+NodePointer analyzeList(const SchemeCons *cons, Scope *scope)
+{
+    auto operands = vectorFromExpr(cdr(cons));
+    SchemeArgs args(operands);
+    switch (keywordOf(car(cons))) {
+    case Keyword::And:
+        return std::make_shared<And>(
+            analyzeAll(args.begin(), args.end(), scope));
+    case Keyword::Begin:
+        return analyzeBegin(args.begin(), args.end(), scope);
+    case Keyword::If:         return analyzeIf(args, scope);
+    case Keyword::Define:     return analyzeDefine(args, scope);
+    case Keyword::Lambda:     return analyzeLambda(args, scope);
+    case Keyword::Quasiquote: return analyzeQuasiquote(args, scope);
+    case Keyword::Quote:      return analyzeQuote(args);
+    case Keyword::Or:
+        return std::make_shared<Or>(
+            analyzeAll(args.begin(), args.end(), scope));
+    case Keyword::Set:        return analyzeSet(args, scope);
+    case Keyword::Unquote:
+        throw scheme_error("unquote outside of quasiquote");
+    case Keyword::UnquoteSplicing:
+        throw scheme_error ("unquote-splicing outside of quasiquote");
+    case Keyword::None:
+        break;
+    }
+    return std::make_shared<Funcall>(
+        analyze(car(cons), scope),
+        analyzeAll(args.begin(), args.end(), scope));
+}
+
+NodePointer analyze(const SchemeExpr& e, Scope *scope)
+{
+    if (e.isSymbol()) {
+        const auto& symbol = asSymbol(e);
+        auto address = resolve(symbol, scope);
+        if (address.global) {
+            return std::make_shared<GlobalVariable>(symbol, address.depth);
         } else {
-            throw scheme_error("Illegal rest parameter in lambda list");
+            return std::make_shared<LocalVariable>(symbol, address.depth,
+                                                   address.slot);
         }
+    } else if (e.isCons()) {
+        return analyzeList(asCons(e), scope);
+    } else if (e.isNil()) {
+        throw scheme_error("Missing function in ()");
+    } else {
+        return std::make_shared<Constant>(e);
     }
+}
 
-    auto bodyVector = args;
-    bodyVector[0] = parse("begin");
-    auto bodyExpr = consFromVector(bodyVector);
+} // end namespace
 
-    return std::make_shared<LexicalFunction>(
-        LexicalFunction(params, bodyExpr, hasRestParam, env));
+NodePointer analyze(const SchemeExpr& e)
+{
+    return analyze(e, nullptr);
 }
 
-SchemeExpr evalVisitor::evalOr(const SchemeArgs& args, envPointer env) const
+void PrimitiveFunction::wrongArgCount(std::size_t passed) const
 {
-    for (const SchemeExpr& e : args) {
-        auto evalled = eval(e, env);
-        try {
-            if (boolValue(evalled)) return true;
-            // else ignore #f
-        } catch (const scheme_error&) {
-            return evalled;
-        }
+    static const char *const counts[] = { "one", "two", "three", "four" };
+    std::ostringstream error;
+    error << name;
+    if (arity == 0) {
+        error << " does not take arguments";
+    } else if (arity == 1) {
+        error << " requires one argument";
+    } else if (arity <= 4) {
+        error << " requires " << counts[arity - 1] << " arguments";
+    } else {
+        error << " requires " << arity << " arguments";
     }
-    return false;
+    error << ", passed " << passed;
+    throw scheme_error(error);
 }
 
-SchemeExpr
-evalVisitor::evalQuasiquote(const SchemeArgs& args, envPointer env) const
+SchemeExpr LexicalFunction::executeBody(const SchemeArgs& args,
+                                        TailCall& call) const
 {
-    if (args.size() != 1) {
-        std::ostringstream error;
-        error << "quasiquote requires one argument, passed " << args.size();
-        throw scheme_error(error);
-    } else {
-        SchemeCons cons;
-        try { cons = consValue(args.front()); }
-        catch (const scheme_error&) { return args.front(); }
-            
-        std::ostringstream carStrStream;
-        carStrStream << cons.first;
-        std::string carStr = carStrStream.str();
-        if (carStr == "unquote-splicing") {
-            throw scheme_error("Invalid splice in quasiquote");
-        } else if (carStr == "unquote") {
-            auto consVec = vectorFromCons(cons);
-            if (consVec.size() != 2) {
-                std::ostringstream error;
-                error << "Unquote requires one argument, passed ";
-                error << args.size();
-                throw scheme_error(error);
-            } else {
-                return eval(consVec[1], env);
-            }
+    safePoint();
+    auto execEnv = makeHandle<SchemeEnvironment>(
+        frameSize, paramCount, args.data(), args.size(), hasRestParam, env);
+    SchemeExpr result = body->executeTail(execEnv.get(), call);
+    if (!hasLambdas) releaseFrame(execEnv);
+    return result;
+}
+
+void LexicalFunction::trace(Tracer& tracer) const
+{
+    tracer.mark(env);
+}
+
+// The trampoline: make each tail call the body leaves behind until one
+// of them returns a value. Calls to other LexicalFunctions run their
+// bodies here rather than through operator(), so they don't nest.
+SchemeExpr LexicalFunction::operator()(const SchemeArgs& args)
+{
+    TailCall call;
+    SchemeExpr result = executeBody(args, call);
+
+    // The arguments stay in call while the function runs: a body copies
+    // them into its frame before it can leave another call there.
+    while (call.pending) {
+        call.pending = false;
+        SchemeExpr function = std::move(call.function);
+        if (function.isHeapType(HeapType::Lexical)) {
+            auto lexical = static_cast<LexicalFunction *>(asFunction(function));
+            result = lexical->executeBody(call.args, call);
         } else {
-            try {
-                auto subCons = consValue(car(cons));
-                std::ostringstream subCar;
-                subCar << car(subCons);
-                if (subCar.str() == "unquote-splicing") {
-                    return append(eval(car(consValue(cdr(subCons))), env),
-                                  evalQuasiquote({cdr(cons)}, env));
-                }
-            } catch (const scheme_error&) {
-            } // not unquote-splicing, so treat it like normal
-            auto carVal = evalQuasiquote({car(cons)}, env);
-            auto cdrVal = evalQuasiquote({cdr(cons)}, env);
-            return SchemeCons(carVal, cdrVal);
+            result = callFunction(asFunction(function), call.args.data(),
+                                  call.args.size());
         }
     }
+
+    return result;
+}
+
+namespace {
+
+EvalMode currentMode = EvalMode::Tree;
+
+} // end namespace
+
+void setEvalMode(EvalMode mode)
+{
+    currentMode = mode;
+}
+
+EvalMode evalMode()
+{
+    return currentMode;
 }
 
-SchemeExpr evalVisitor::evalQuote(const SchemeArgs& args) const
+SchemeExpr eval(const SchemeExpr& e, const EnvPointer& env)
 {
-    if (args.size() != 1) {
-        std::ostringstream error;
-        error << "quote requires one argument, passed " << args.size();
-        throw scheme_error(error);
+    safePoint();
+    if (currentMode == EvalMode::Bytecode) {
+        return execute(compile(e), env);
     } else {
-        return args.front();
+        return analyze(e)->execute(env.get());
     }
 }
 
-std::istream& evalStream(std::istream& in,
-                         std::shared_ptr<SchemeEnvironment> env)
+std::istream& evalStream(std::istream& in, const EnvPointer& env)
 {
     SchemeExpr expr;
     while (readSchemeExpr(in, expr)) eval(expr, env);
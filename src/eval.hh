@@ -3,171 +3,227 @@
 
 #include <deque>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <type_traits>
 #include <vector>
-#include <boost/variant.hpp>
 #include "parser.hh"
 #include "scheme_types.hh"
 
-typedef std::vector<SchemeExpr> SchemeArgs;
-SchemeExpr eval(SchemeExpr e, std::shared_ptr<SchemeEnvironment> env);
-std::istream& evalStream(std::istream&, std::shared_ptr<SchemeEnvironment>);
-
-struct SchemeFunction {
-    virtual SchemeExpr operator()(const SchemeArgs& args) = 0;
+// Evaluation happens in two stages. analyze() walks an expression once,
+// checking its syntax and resolving special forms, and produces a tree
+// of Nodes. Executing a Node then only does the work the program asks
+// for: no re-parsing of the cons tree and no syntax checks.
+
+// A call from tail position that hasn't been made yet. The function
+// whose body made it calls it once the body has returned, so a chain
+// of tail calls runs in constant C++ stack.
+struct TailCall {
+    SchemeExpr function;
+    ArgBuffer args;
+    bool pending = false;
 };
 
-class PrimitiveFunction : public SchemeFunction {
-    std::function<SchemeExpr(SchemeArgs)> fn;
-public:
-    PrimitiveFunction(std::function<SchemeExpr(const SchemeArgs&)> fn)//,
-        : fn(fn)
-        {}
-    virtual SchemeExpr operator()(const SchemeArgs& args) override {
-        return fn(args);
-    }
-};
+// Nodes borrow the environment they run in. Whoever calls execute()
+// keeps it rooted until the call returns, and environments never move,
+// so passing it down the tree doesn't touch its root count.
+struct Node {
+    using envPointer = SchemeEnvironment *;
 
-class LexicalFunction : public SchemeFunction {
-    std::vector<SchemeSymbol> params;
-    SchemeExpr body;
-    bool hasRestParam;
-    std::shared_ptr<SchemeEnvironment> env;
-public:
-    LexicalFunction(std::vector<SchemeSymbol> params, SchemeExpr body,
-                    bool hasRestParam, std::shared_ptr<SchemeEnvironment> env)
-        : params(params), body(body), hasRestParam(hasRestParam), env(env)
-    {}
+    virtual ~Node() = default;
+    virtual SchemeExpr execute(envPointer env) const = 0;
 
-    virtual SchemeExpr operator()(const SchemeArgs& args) override {
-        auto execEnv = std::make_shared<SchemeEnvironment>(
-            SchemeEnvironment(params, args, hasRestParam, env));
-        return eval(body, execEnv);
+    // Executes the node as the last thing a function body does. Nodes
+    // that end in a call leave it in call instead of making it, and
+    // their return value is ignored.
+    virtual SchemeExpr executeTail(envPointer env, TailCall&) const {
+        return execute(env);
     }
 };
 
-class evalVisitor : public boost::static_visitor<SchemeExpr> {
-    using envPointer = std::shared_ptr<SchemeEnvironment>;
-    envPointer env;
-    SchemeExpr evalAnd(const SchemeArgs& args, envPointer env) const;
-    SchemeExpr evalBegin(const SchemeArgs& args, envPointer env) const;
-    SchemeExpr evalDefine(const SchemeArgs& args, envPointer env) const;
-    SchemeExpr evalFuncall(const SchemeExpr& car, const SchemeArgs& args,
-                           envPointer env) const;
-    SchemeExpr evalIf(const SchemeArgs& args, envPointer env) const;
-    SchemeExpr evalLambda(const SchemeArgs& args, envPointer env) const;
-    SchemeExpr evalOr(const SchemeArgs& args, envPointer env) const;
-    SchemeExpr evalSet(const SchemeArgs& args, envPointer env) const;
-    SchemeExpr evalSymbol(const SchemeSymbol& symbol, envPointer env) const;
-    SchemeExpr evalQuasiquote(const SchemeArgs& args, envPointer env) const;
-    SchemeExpr evalQuote(const SchemeArgs& args) const;
+typedef std::shared_ptr<const Node> NodePointer;
+
+NodePointer analyze(const SchemeExpr& e);
+
+// eval() and evalStream() either execute the analyzed node tree or
+// compile to bytecode and run it on the VM (see compiler.hh and vm.hh).
+// Functions made in one mode can be called from the other.
+enum class EvalMode { Tree, Bytecode };
+
+void setEvalMode(EvalMode mode);
+EvalMode evalMode();
+
+SchemeExpr eval(const SchemeExpr& e, const EnvPointer& env);
+std::istream& evalStream(std::istream&, const EnvPointer&);
+
+// A primitive is either variadic, taking its arguments as passed, or
+// fixed: it takes exactly arity arguments, which the PrimitiveFunction
+// has counted before it calls it. Primitives are the only functions
+// whose heapType is Function, so the evaluators can tell them apart and
+// call them with callFunction, without a virtual call.
+class PrimitiveFunction final : public SchemeFunction {
 public:
-    evalVisitor(std::shared_ptr<SchemeEnvironment> env) : env(env) {}
+    typedef SchemeExpr (*Variadic)(const SchemeArgs& args);
+    typedef SchemeExpr (*Fixed)(const SchemeExpr *args);
 
-    SchemeExpr operator()(bool b) const {
-        return b;
-    }
+    static const std::size_t variadic = static_cast<std::size_t>(-1);
 
-    SchemeExpr operator()(char c) const {
-        return c;
-    }
+    const char *const name;
+    const std::size_t arity;
+private:
+    Variadic variadicFunction = nullptr;
+    Fixed fixedFunction = nullptr;
 
-    SchemeExpr operator()(int i) const {
-        return i;
+    [[noreturn]] void wrongArgCount(std::size_t passed) const;
+public:
+    PrimitiveFunction(const char *name, Variadic function)
+        : SchemeFunction(HeapType::Function), name(name), arity(variadic),
+          variadicFunction(function) {}
+    PrimitiveFunction(const char *name, std::size_t arity, Fixed function)
+        : SchemeFunction(HeapType::Function), name(name), arity(arity),
+          fixedFunction(function) {}
+
+    SchemeExpr call(const SchemeExpr *args, std::size_t count) const {
+        if (arity == variadic) {
+            return variadicFunction(SchemeArgs(args, count));
+        }
+        if (count != arity) wrongArgCount(count);
+        return fixedFunction(args);
     }
 
-    SchemeExpr operator()(const std::string& string) const {
-        return string;
+    virtual SchemeExpr operator()(const SchemeArgs& args) override {
+        return call(args.data(), args.size());
     }
+};
 
-    SchemeExpr operator()(const SchemeSymbol& symbol) const {
-        return evalSymbol(symbol, env);
+// Calls function on count arguments. A primitive's function pointer is
+// called directly, a typed one's after checking the count against its
+// arity; other functions are called through operator().
+inline SchemeExpr callFunction(SchemeFunction *function,
+                               const SchemeExpr *args, std::size_t count)
+{
+    if (function->heapType == HeapType::Function) {
+        return static_cast<PrimitiveFunction *>(function)->call(args, count);
+    } else {
+        return (*function)(SchemeArgs(args, count));
     }
+}
+
+// Typed primitives are plain C++ functions, such as int(int, int),
+// whose parameters are any of the types Unboxed converts arguments to
+// and whose result converts to a SchemeExpr. TypedPrimitive generates
+// the Fixed function that unboxes the arguments, calls it and boxes
+// the result, so it only has to do the work itself.
+template <typename T> struct Unboxed;
+
+template <> struct Unboxed<SchemeExpr> {
+    static const SchemeExpr& from(const SchemeExpr& e) { return e; }
+};
+
+template <> struct Unboxed<int> {
+    static int from(const SchemeExpr& e) { return intValue(e); }
+};
+
+template <> struct Unboxed<bool> {
+    static bool from(const SchemeExpr& e) { return boolValue(e); }
+};
+
+template <> struct Unboxed<char> {
+    static char from(const SchemeExpr& e) { return charValue(e); }
+};
 
-    SchemeExpr operator()(const std::shared_ptr<SchemeFunction>& fn) const {
-        return fn;
+template <> struct Unboxed<std::string> {
+    static const std::string& from(const SchemeExpr& e) {
+        return stringValue(e);
     }
+};
 
-    SchemeExpr operator()(const Nil&) const {
-        throw scheme_error("Missing function in ()");
+template <> struct Unboxed<SchemeSymbol> {
+    static const SchemeSymbol& from(const SchemeExpr& e) {
+        return symbolValue(e);
     }
+};
 
-    SchemeExpr operator()(const SchemeCons& cons) const {
-        std::ostringstream carStream;
-        carStream << car(cons);
-        std::string carStr = carStream.str();
-        SchemeArgs args = vectorFromExpr(cdr(cons));
-             if (carStr == "and")        return evalAnd(args, env);
-        else if (carStr == "begin")      return evalBegin(args, env);
-        else if (carStr == "if")         return evalIf(args, env);
-        else if (carStr == "define")     return evalDefine(args, env);
-        else if (carStr == "lambda")     return evalLambda(args, env);
-        else if (carStr == "quasiquote") return evalQuasiquote(args, env);
-        else if (carStr == "quote")      return evalQuote(args);
-        else if (carStr == "or")         return evalOr(args, env);
-        else if (carStr == "set!")       return evalSet(args, env);
-        else if (carStr == "unquote") {
-            throw scheme_error("unquote outside of quasiquote");
-        } else if (carStr == "unquote-splicing") {
-            throw scheme_error ("unquote-splicing outside of quasiquote");
-        } else {
-            SchemeExpr op = eval(car(cons), env);
-            return evalFuncall(op, args, env);
-        }
+template <> struct Unboxed<SchemeCons *> {
+    static SchemeCons *from(const SchemeExpr& e) { return consValue(e); }
+};
+
+template <> struct Unboxed<SchemeFunction *> {
+    static SchemeFunction *from(const SchemeExpr& e) {
+        return functionPointer(e);
     }
 };
 
-inline SchemeExpr
-evalVisitor::evalDefine(const SchemeArgs& args, envPointer env) const
-{
-    if (args.size() == 2) {
-        auto var = symbolValue(args[0]);
-        (*env)[var.string] = eval(args[1], env);
-        return args.front();
-    } else {
-        std::ostringstream error;
-        error << "define requires two arguments, passed " << args.size();
-        throw scheme_error(error);
+template <std::size_t... I> struct Indices {};
+
+template <std::size_t N, std::size_t... I>
+struct MakeIndices : MakeIndices<N - 1, N - 1, I...> {};
+
+template <std::size_t... I>
+struct MakeIndices<0, I...> {
+    typedef Indices<I...> type;
+};
+
+template <typename Signature, Signature *function> struct TypedPrimitive;
+
+template <typename Result, typename... Params,
+          Result (*function)(Params...)>
+struct TypedPrimitive<Result(Params...), function> {
+    static const std::size_t arity = sizeof...(Params);
+
+    static SchemeExpr call(const SchemeExpr *args) {
+        return call(args, typename MakeIndices<arity>::type());
     }
-}
 
-inline SchemeExpr
-evalVisitor::evalSet(const SchemeArgs& args, envPointer env) const
-{
-    if (args.size() != 2) {
-        std::ostringstream error;
-        error << "set! requires two arguments, passed " << args.size();
-        throw scheme_error(error);
-    } else {
-        auto var = symbolValue(args[0]);
-        auto definingEnv = env->find(var.string);
-        if (definingEnv == nullptr) {
-            std::ostringstream error;
-            error << "Undefined symbol: " << var;
-            throw scheme_error(error);
-        } else {
-            (*definingEnv)[var.string] = eval(args[1], env);
-            return var;
-        }
+private:
+    template <std::size_t... I>
+    static SchemeExpr call(const SchemeExpr *args, Indices<I...>) {
+        (void)args;             // unused by functions of no arguments
+        return function(
+            Unboxed<typename std::decay<Params>::type>::from(args[I])...);
     }
-}
+};
 
-inline SchemeExpr
-evalVisitor::evalSymbol(const SchemeSymbol& symbol, envPointer env) const
+// The TypedPrimitive for a function, to pass to addPrimitive.
+#define SCHEME_TYPED(function) TypedPrimitive<decltype(function), function>()
+
+template <typename Signature, Signature *function>
+void addPrimitive(SchemeEnvironment& env, const char *name,
+                  TypedPrimitive<Signature, function>)
 {
-    envPointer definingEnv = env->find(symbol.string);
-    if (definingEnv) {
-        return (*definingEnv)[symbol.string];
-    } else {
-        std::ostringstream error;
-        error << "Undefined symbol: " << symbol;
-        throw scheme_error(error);
-    }
+    typedef TypedPrimitive<Signature, function> Typed;
+    env.define(*intern(name),
+               new PrimitiveFunction(name, Typed::arity, &Typed::call));
 }
 
-inline SchemeExpr eval(SchemeExpr e, std::shared_ptr<SchemeEnvironment> env)
+inline void addPrimitive(SchemeEnvironment& env, const char *name,
+                         PrimitiveFunction::Variadic function)
 {
-    return boost::apply_visitor(evalVisitor(env), e);
+    env.define(*intern(name), new PrimitiveFunction(name, function));
 }
 
+class LexicalFunction : public SchemeFunction {
+    std::size_t paramCount;
+    std::size_t frameSize;      // parameters plus variables the body defines
+    NodePointer body;
+    bool hasRestParam;
+    bool hasLambdas;            // so its frames may outlive their calls
+    SchemeEnvironment *env;
+public:
+    LexicalFunction(std::size_t paramCount, std::size_t frameSize,
+                    NodePointer body, bool hasRestParam, bool hasLambdas,
+                    SchemeEnvironment *env)
+        : SchemeFunction(HeapType::Lexical), paramCount(paramCount),
+          frameSize(frameSize), body(std::move(body)),
+          hasRestParam(hasRestParam), hasLambdas(hasLambdas), env(env)
+    {}
+
+    virtual SchemeExpr operator()(const SchemeArgs& args) override;
+
+    virtual void trace(Tracer& tracer) const override;
+
+private:
+    SchemeExpr executeBody(const SchemeArgs& args, TailCall& call) const;
+};
+
 #endif
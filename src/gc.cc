@@ -0,0 +1,1012 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>  // for std::ref
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+#include "gc.hh"
+#include "scheme_types.hh"
+
+bool collectionDue = false;
+bool markingInProgress = false;
+AllocationBuffer nursery = { nullptr, nullptr };
+
+namespace {
+
+// Make a minor collection once this much has been allocated since the
+// last one, counting a nursery block as allocated when it's started.
+const std::size_t youngThreshold = 1 << 20;
+
+// While a Region is open, wait until this much has been allocated. This
+// also bounds the work closing one does, which reads every pair in it.
+const std::size_t regionThreshold = 64 << 20;
+
+// Make a major collection once this much has survived minor collections
+// since the last one, or as much as survived that if it's more, so the
+// time spent collecting stays proportional to the time spent allocating.
+const std::size_t minimumThreshold = 4 << 20;
+
+// The nursery is made of blocks, which are kept for reuse.
+const std::size_t blockSize = 32 << 10;
+const std::size_t freeBlocks = 32;
+
+// An incremental slice checks the clock after tracing or sweeping this
+// many objects, and always does at least that much.
+const std::size_t markSlice = 256;
+const std::size_t sweepSlice = 1024;
+
+// The pause percentiles are over this many of the most recent pauses.
+const std::size_t pauseSamples = 1024;
+
+// Marking threads hand work to each other in chunks of this many
+// objects, and only help with heaps of at least parallelMinimum bytes.
+const std::size_t markChunk = 256;
+const std::size_t parallelMinimum = 1 << 20;
+
+// Compact the old pair space when more than this fraction of its slots
+// are free, moving the pairs out of the blocks that are less than half
+// full.
+const double compactionThreshold = 0.5;
+
+// Objects other than pairs up to largestPooled bytes, and the slots of
+// frames, come from a pool for their size, rounded up to a multiple of
+// sizeClass. Each pool carves them out of chunks of poolChunk bytes and
+// keeps those freed on a list for reuse.
+const std::size_t sizeClass = 16;
+const std::size_t largestPooled = 256;
+const std::size_t poolChunk = 16 << 10;
+
+typedef std::chrono::steady_clock Clock;
+
+enum class Phase { Idle, Marking, Sweeping };
+
+// Marks in parallel on a pool of threads, the collecting thread being
+// the first. Each traces from its own stack, and when that grows deep
+// publishes a chunk from the bottom of it, where threads that have run
+// out of work steal it. Marking is over once every thread is idle with
+// no chunks left to steal, since only a busy thread can publish one.
+class MarkPool {
+    struct Worker {
+        Tracer tracer;
+        std::mutex lock;
+        std::vector<std::vector<HeapObject *>> chunks;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> helpers;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    unsigned round = 0;                 // of marking, to start helpers
+    unsigned running = 0;               // helpers still marking
+    bool stopping = false;
+    std::atomic<std::size_t> published;
+    std::atomic<unsigned> idle;
+
+    void publish(Worker& worker);
+    bool steal(Worker& thief);
+    void work(Worker& worker);
+    void help(Worker& worker);
+public:
+    explicit MarkPool(unsigned threads);
+    ~MarkPool();
+
+    unsigned size() const { return workers.size(); }
+
+    // Marks everything reachable from the objects pending in tracer.
+    void mark(Tracer& tracer);
+};
+
+MarkPool::MarkPool(unsigned threads) : published(0), idle(0)
+{
+    for (unsigned i = 0; i < threads; ++i) {
+        workers.emplace_back(new Worker);
+    }
+    for (unsigned i = 1; i < threads; ++i) {
+        helpers.emplace_back(&MarkPool::help, this, std::ref(*workers[i]));
+    }
+}
+
+MarkPool::~MarkPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& helper : helpers) helper.join();
+}
+
+void MarkPool::publish(Worker& worker)
+{
+    std::vector<HeapObject *> chunk;
+    worker.tracer.share(chunk, markChunk);
+    std::lock_guard<std::mutex> guard(worker.lock);
+    worker.chunks.push_back(std::move(chunk));
+    ++published;
+}
+
+bool MarkPool::steal(Worker& thief)
+{
+    for (auto& victim : workers) {
+        if (!published) return false;
+        std::lock_guard<std::mutex> guard(victim->lock);
+        if (!victim->chunks.empty()) {
+            thief.tracer.adopt(victim->chunks.back());
+            victim->chunks.pop_back();
+            --published;
+            return true;
+        }
+    }
+    return false;
+}
+
+void MarkPool::work(Worker& worker)
+{
+    for (;;) {
+        while (!worker.tracer.drain(markChunk)) {
+            if (worker.tracer.pendingCount() >= 2 * markChunk
+                && published < workers.size()) {
+                publish(worker);
+            }
+        }
+        if (steal(worker)) continue;
+
+        ++idle;
+        while (!published) {
+            if (idle == workers.size()) return;
+            std::this_thread::yield();
+        }
+        --idle;
+    }
+}
+
+void MarkPool::help(Worker& worker)
+{
+    unsigned seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [&] { return stopping || round != seen; });
+            if (stopping) return;
+            seen = round;
+        }
+        work(worker);
+        std::lock_guard<std::mutex> guard(lock);
+        if (--running == 0) finished.notify_one();
+    }
+}
+
+void MarkPool::mark(Tracer& tracer)
+{
+    for (std::size_t i = 0; tracer.pendingCount(); ++i) {
+        Worker& worker = *workers[i % workers.size()];
+        worker.chunks.emplace_back();
+        tracer.share(worker.chunks.back(), markChunk);
+        ++published;
+    }
+    idle = 0;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        running = helpers.size();
+        ++round;
+    }
+    wake.notify_all();
+    work(*workers.front());
+    std::unique_lock<std::mutex> guard(lock);
+    finished.wait(guard, [this] { return running == 0; });
+}
+
+struct Block {
+    alignas(SchemeCons) char memory[blockSize];
+    char *end;                  // end of the pairs allocated in it
+    std::size_t live;           // pinned or old pairs, once out of the nursery
+
+    SchemeCons *begin() {
+        return reinterpret_cast<SchemeCons *>(memory);
+    }
+
+    SchemeCons *finish() {
+        return reinterpret_cast<SchemeCons *>(end);
+    }
+};
+
+// Freed objects are linked through their first word. Chunks are never
+// returned to the system, since the pool is likely to need them again.
+struct Pool {
+    void *free = nullptr;
+    char *top = nullptr;
+    char *limit = nullptr;
+    std::size_t allocations = 0;
+    std::size_t recycled = 0;
+    std::size_t chunks = 0;
+};
+
+// Every object but the pairs is in objects, and those from youngStart
+// on are Young. While a major collection is sweeping, those before
+// sweepEnd are being swept in place: the survivors among the first
+// sweepNext have been moved down to before sweepLive. The blocks of
+// the old pair space before pairSweepEnd are swept the same way.
+struct Heap {
+    std::vector<HeapObject *> objects;
+    std::size_t youngStart = 0;
+    std::vector<Block *> nursery;       // the last one is being filled
+    std::vector<Block *> retained;      // blocks holding pinned pairs
+    std::vector<Block *> pairs;         // old pairs, the last being filled
+    char *pairTop = nullptr;            // where the next old pair goes
+    char *pairLimit = nullptr;
+    std::vector<Block *> free;
+    std::vector<HeapObject *> remembered;
+    std::size_t bytes = 0;              // in objects
+    std::size_t allocated = 0;          // since the last minor collection
+    std::size_t threshold = minimumThreshold;   // bytes for a major one
+    std::size_t collections = 0;
+    std::size_t minorCollections = 0;
+    std::size_t freed = 0;
+    std::size_t promoted = 0;
+    double pauseSeconds = 0;
+    double longestPauseSeconds = 0;
+    std::vector<double> pauses;         // the last pauseSamples of them
+    std::size_t pauseCount = 0;
+    bool sweeping = false;
+    Phase phase = Phase::Idle;          // of the major collection
+    Tracer marker;                      // its grey objects
+    std::size_t sweepNext = 0;
+    std::size_t sweepLive = 0;
+    std::size_t sweepEnd = 0;
+    std::size_t pairSweepNext = 0;
+    std::size_t pairSweepLive = 0;
+    std::size_t pairSweepEnd = 0;
+    std::size_t compactions = 0;
+    double pauseTarget = 0;
+    double markSeconds = 0;
+    unsigned markThreads = 0;           // as set, zero for one per core
+    std::unique_ptr<MarkPool> pool;
+    Pool pools[largestPooled / sizeClass];
+    std::size_t framesReleased = 0;
+    unsigned regions = 0;               // open, counting nested ones
+    std::size_t regionsClosed = 0;
+};
+
+// Never destroyed, since SchemeExprs in other static objects may still
+// release their roots during exit.
+Heap& heap()
+{
+    static Heap& heap = *new Heap;
+    return heap;
+}
+
+void trace(HeapObject *object, Tracer& tracer)
+{
+    switch (object->heapType) {
+    case HeapType::String:
+    case HeapType::Symbol:
+        break;
+    case HeapType::Cons:
+        tracer.mark(static_cast<SchemeCons *>(object)->car);
+        tracer.mark(static_cast<SchemeCons *>(object)->cdr);
+        break;
+    case HeapType::Environment:
+        static_cast<SchemeEnvironment *>(object)->trace(tracer);
+        break;
+    case HeapType::Function:
+    case HeapType::Lexical:
+    case HeapType::Closure:
+        static_cast<SchemeFunction *>(object)->trace(tracer);
+        break;
+    }
+}
+
+void noteAllocation(Heap& h)
+{
+    if (h.allocated >= (h.regions ? regionThreshold : youngThreshold)) {
+        collectionDue = true;
+    }
+}
+
+Block *takeBlock(Heap& h)
+{
+    if (h.free.empty()) return new Block;
+    Block *block = h.free.back();
+    h.free.pop_back();
+    return block;
+}
+
+void releaseBlock(Heap& h, Block *block)
+{
+    if (h.free.size() < freeBlocks) {
+        h.free.push_back(block);
+    } else {
+        delete block;
+    }
+}
+
+// Records where allocation in the block being filled got to.
+void closeNursery(Heap& h)
+{
+    if (!h.nursery.empty()) h.nursery.back()->end = nursery.top;
+    nursery.top = nursery.limit = nullptr;
+}
+
+std::size_t pairsIn(Block *block)
+{
+    return block->finish() - block->begin();
+}
+
+// Records where allocation in the old pair block being filled got to.
+void syncPairs(Heap& h)
+{
+    if (h.pairTop) h.pairs.back()->end = h.pairTop;
+}
+
+// Stops allocating old pairs in the block being filled, so that the
+// next starts a new block.
+void closePairs(Heap& h)
+{
+    syncPairs(h);
+    h.pairTop = h.pairLimit = nullptr;
+}
+
+// Memory for an Old pair, in the old pair space. Its blocks count
+// towards the heap's bytes in full, so fragmentation brings on major
+// collections sooner.
+void *allocatePair(Heap& h)
+{
+    if (static_cast<std::size_t>(h.pairLimit - h.pairTop)
+        < sizeof(SchemeCons)) {
+        closePairs(h);
+        Block *block = takeBlock(h);
+        block->live = 0;
+        h.pairs.push_back(block);
+        h.bytes += blockSize;
+        h.pairTop = block->memory;
+        h.pairLimit = block->memory + blockSize;
+    }
+    void *memory = h.pairTop;
+    h.pairTop += sizeof(SchemeCons);
+    ++h.pairs.back()->live;
+    return memory;
+}
+
+bool isLivePair(SchemeCons *pair)
+{
+    return (pair->space == Space::Old || pair->space == Space::Pinned)
+        && pair->marked;
+}
+
+// Frees the dead pairs in a block of old or pinned pairs, and the slots
+// of those a compaction has copied elsewhere, clearing the marks of the
+// live ones. Returns the number that died.
+std::size_t sweepBlock(Block *block)
+{
+    std::size_t freed = 0;
+    block->live = 0;
+    for (auto pair = block->begin(); pair != block->finish(); ++pair) {
+        if (isLivePair(pair)) {
+            pair->marked.store(false, std::memory_order_relaxed);
+            ++block->live;
+        } else if (pair->space == Space::Moved) {
+            pair->space = Space::Free;
+        } else if (pair->space != Space::Free) {
+            pair->space = Space::Free;
+            ++freed;
+        }
+    }
+    return freed;
+}
+
+// Frees the unmarked objects from first on, and clears the marks of
+// the others, which are now Old, unless grey is set, when they are
+// left for the major collection's marker to trace instead. Returns the
+// number freed.
+std::size_t sweep(Heap& h, std::size_t first, bool grey)
+{
+    // Objects allocated by destructors during the sweep would be lost,
+    // but no destructor allocates.
+    h.sweeping = true;
+    auto live = h.objects.begin() + first;
+    for (auto it = live; it != h.objects.end(); ++it) {
+        HeapObject *object = *it;
+        if (object->marked) {
+            object->marked.store(false, std::memory_order_relaxed);
+            object->space = Space::Old;
+            if (grey) h.marker.mark(object);
+            *live++ = object;
+        } else {
+            destroyHeapObject(object);
+        }
+    }
+    h.sweeping = false;
+    std::size_t freed = h.objects.end() - live;
+    h.objects.erase(live, h.objects.end());
+    return freed;
+}
+
+// A minor collection: pin the Young pairs that are roots, then trace
+// from them, the other Young roots and the remembered objects,
+// evacuating the Young pairs reached and marking the other Young
+// objects. Blocks with pinned pairs are retained and the rest reused.
+// What survives while a major collection is underway is kept by it.
+// Returns the number of objects freed.
+std::size_t collectYoung(Heap& h)
+{
+    closeNursery(h);
+    Tracer tracer(Tracer::Evacuating);
+
+    for (auto it = h.objects.begin() + h.youngStart; it != h.objects.end();
+         ++it) {
+        if ((*it)->rootCount) tracer.mark(*it);
+    }
+
+    std::size_t young = 0, pinned = 0;
+    for (auto block : h.nursery) {
+        young += pairsIn(block);
+        for (auto pair = block->begin(); pair != block->finish(); ++pair) {
+            if (pair->rootCount) {
+                pair->space = Space::Pinned;
+                ++block->live;
+                tracer.scan(pair);
+                if (h.phase == Phase::Marking) h.marker.mark(pair);
+                if (h.phase == Phase::Sweeping) pair->marked = true;
+            }
+        }
+        pinned += block->live;
+    }
+
+    for (auto object : h.remembered) {
+        object->remembered = false;
+        tracer.scan(object);
+    }
+    h.remembered.clear();
+    tracer.drain();
+
+    for (auto block : h.nursery) {
+        if (!block->live) {
+            releaseBlock(h, block);
+            continue;
+        }
+        for (auto pair = block->begin(); pair != block->finish(); ++pair) {
+            if (pair->space != Space::Pinned) pair->space = Space::Free;
+        }
+        h.retained.push_back(block);
+    }
+    h.nursery.clear();
+
+    syncPairs(h);
+
+    std::size_t freed = young - pinned - tracer.evacuatedCount();
+    freed += sweep(h, h.youngStart, h.phase == Phase::Marking);
+    h.youngStart = h.objects.size();
+    h.allocated = 0;
+    h.minorCollections += 1;
+    h.promoted += tracer.evacuatedCount();
+    return freed;
+}
+
+// Begins a major collection, straight after a minor one so that
+// nothing is Young, by greying the roots among the old objects and
+// pinned pairs.
+void startMarking(Heap& h)
+{
+    for (auto object : h.objects) {
+        if (object->rootCount) h.marker.mark(object);
+    }
+    for (auto blocks : { &h.pairs, &h.retained }) {
+        for (auto block : *blocks) {
+            for (auto pair = block->begin(); pair != block->finish();
+                 ++pair) {
+                if (pair->space != Space::Free && pair->rootCount) {
+                    h.marker.mark(pair);
+                }
+            }
+        }
+    }
+    h.phase = Phase::Marking;
+    markingInProgress = true;
+}
+
+// Between marking and sweeping, when more than compactionThreshold of
+// the old pair space is free: copies the live pairs that aren't roots
+// out of the blocks less than half full into new ones, then updates
+// every reference to them from the live objects. The sweep then frees
+// the blocks they came from, unless a root is still there.
+void compact(Heap& h)
+{
+    std::size_t slots = 0, live = 0;
+    std::vector<Block *> sparse;
+    for (auto blocks : { &h.pairs, &h.retained }) {
+        for (auto block : *blocks) {
+            block->live = 0;
+            for (auto pair = block->begin(); pair != block->finish();
+                 ++pair) {
+                if (isLivePair(pair)) ++block->live;
+            }
+            slots += pairsIn(block);
+            live += block->live;
+            if (block->live * 2 < pairsIn(block)) sparse.push_back(block);
+        }
+    }
+    if (live >= slots * (1 - compactionThreshold)) return;
+
+    for (auto block : sparse) {
+        for (auto pair = block->begin(); pair != block->finish(); ++pair) {
+            if (!isLivePair(pair) || pair->rootCount) continue;
+            auto copy = ::new (allocatePair(h))
+                SchemeCons(pair->car, pair->cdr, Space::Old);
+            copy->marked.store(true, std::memory_order_relaxed);
+            pair->car = HeapExpr(copy);
+            pair->space = Space::Moved;
+        }
+    }
+    closePairs(h);
+
+    Tracer forwarder(Tracer::Forwarding);
+    for (auto object : h.objects) {
+        if (object->marked) forwarder.scan(object);
+    }
+    for (auto blocks : { &h.pairs, &h.retained }) {
+        for (auto block : *blocks) {
+            for (auto pair = block->begin(); pair != block->finish();
+                 ++pair) {
+                if (isLivePair(pair)) forwarder.scan(pair);
+            }
+        }
+    }
+    forwarder.drain();
+    h.compactions += 1;
+}
+
+MarkPool *markPool(Heap& h)
+{
+    unsigned threads = h.markThreads;
+    if (!threads) threads = std::max(1u, std::thread::hardware_concurrency());
+    if (!h.pool || h.pool->size() != threads) {
+        h.pool.reset();
+        h.pool.reset(new MarkPool(threads));
+    }
+    return h.pool.get();
+}
+
+// Traces grey objects until there are none left, when the sweep can
+// begin, or the deadline has passed. Without a deadline, a large heap
+// is marked in parallel.
+void markOld(Heap& h, Clock::time_point deadline)
+{
+    auto start = Clock::now();
+    if (deadline == Clock::time_point::max()
+        && h.bytes >= parallelMinimum && markPool(h)->size() > 1) {
+        h.pool->mark(h.marker);
+    }
+    while (!h.marker.drain(markSlice)) {
+        if (Clock::now() >= deadline) break;
+    }
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+    h.markSeconds += elapsed.count();
+    if (h.marker.pendingCount()) return;
+
+    markingInProgress = false;
+    closePairs(h);
+    if (deadline == Clock::time_point::max()) compact(h);
+    h.phase = Phase::Sweeping;
+    h.sweepNext = h.sweepLive = 0;
+    h.sweepEnd = h.youngStart;
+    h.pairSweepNext = h.pairSweepLive = 0;
+    h.pairSweepEnd = h.pairs.size();
+}
+
+// Frees the dead pinned pairs and the blocks left empty.
+std::size_t sweepRetained(Heap& h)
+{
+    std::size_t freed = 0;
+    auto kept = h.retained.begin();
+    for (auto block : h.retained) {
+        freed += sweepBlock(block);
+        if (block->live) {
+            *kept++ = block;
+        } else {
+            releaseBlock(h, block);
+        }
+    }
+    h.retained.erase(kept, h.retained.end());
+    return freed;
+}
+
+// Sweeps the old objects, then the old pair space a block at a time,
+// until they're all done, ending the major collection, or the deadline
+// has passed. Returns the number freed.
+std::size_t sweepOld(Heap& h, Clock::time_point deadline)
+{
+    std::size_t freed = 0;
+    do {
+        if (h.sweepNext != h.sweepEnd) {
+            std::size_t end = std::min(h.sweepNext + sweepSlice, h.sweepEnd);
+            h.sweeping = true;
+            for (; h.sweepNext != end; ++h.sweepNext) {
+                HeapObject *object = h.objects[h.sweepNext];
+                if (object->marked) {
+                    object->marked.store(false, std::memory_order_relaxed);
+                    h.objects[h.sweepLive++] = object;
+                } else {
+                    destroyHeapObject(object);
+                    ++freed;
+                }
+            }
+            h.sweeping = false;
+        } else if (h.pairSweepNext != h.pairSweepEnd) {
+            Block *block = h.pairs[h.pairSweepNext++];
+            freed += sweepBlock(block);
+            if (block->live) {
+                h.pairs[h.pairSweepLive++] = block;
+            } else {
+                h.bytes -= blockSize;
+                releaseBlock(h, block);
+            }
+        } else {
+            break;
+        }
+    } while (Clock::now() < deadline);
+    if (h.sweepNext != h.sweepEnd || h.pairSweepNext != h.pairSweepEnd) {
+        return freed;
+    }
+
+    auto first = h.objects.begin();
+    h.objects.erase(first + h.sweepLive, first + h.sweepEnd);
+    h.youngStart -= h.sweepEnd - h.sweepLive;
+    h.sweepNext = h.sweepLive = h.sweepEnd = 0;
+    h.pairs.erase(h.pairs.begin() + h.pairSweepLive,
+                  h.pairs.begin() + h.pairSweepEnd);
+    h.pairSweepNext = h.pairSweepLive = h.pairSweepEnd = 0;
+    freed += sweepRetained(h);
+
+    h.threshold = h.bytes + std::max(minimumThreshold, h.bytes);
+    h.collections += 1;
+    h.phase = Phase::Idle;
+    return freed;
+}
+
+// Carries on with the major collection until it's done or the deadline
+// has passed. Returns the number of objects freed.
+std::size_t collectOld(Heap& h, Clock::time_point deadline)
+{
+    if (h.phase == Phase::Marking) markOld(h, deadline);
+    return h.phase == Phase::Sweeping ? sweepOld(h, deadline) : 0;
+}
+
+// Finishes any major collection underway, then makes a whole one.
+std::size_t collectAll(Heap& h)
+{
+    std::size_t freed = collectOld(h, Clock::time_point::max());
+    startMarking(h);
+    return freed + collectOld(h, Clock::time_point::max());
+}
+
+// When a slice of a major collection starting now should stop.
+Clock::time_point sliceDeadline(Heap& h)
+{
+    if (h.pauseTarget <= 0) return Clock::time_point::max();
+    return Clock::now() + std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(h.pauseTarget));
+}
+
+// Runs a collection and accounts for the pause.
+template <typename F>
+std::size_t timed(Heap& h, F collect)
+{
+    auto start = Clock::now();
+    std::size_t freed = collect();
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+
+    h.freed = freed;
+    h.pauseSeconds += elapsed.count();
+    h.longestPauseSeconds = std::max(h.longestPauseSeconds, elapsed.count());
+    if (h.pauses.size() < pauseSamples) {
+        h.pauses.push_back(elapsed.count());
+    } else {
+        h.pauses[h.pauseCount % pauseSamples] = elapsed.count();
+    }
+    h.pauseCount += 1;
+    collectionDue = false;
+    return freed;
+}
+
+double percentile(std::vector<double> samples, double fraction)
+{
+    if (samples.empty()) return 0;
+    auto nth = samples.begin()
+        + static_cast<std::size_t>(fraction * (samples.size() - 1));
+    std::nth_element(samples.begin(), nth, samples.end());
+    return *nth;
+}
+
+} // end namespace
+
+void *allocateSmall(std::size_t size)
+{
+    if (size > largestPooled) return ::operator new(size);
+
+    std::size_t rounded = (size + sizeClass - 1) / sizeClass * sizeClass;
+    Pool& pool = heap().pools[rounded / sizeClass - 1];
+    ++pool.allocations;
+    if (pool.free) {
+        void *memory = pool.free;
+        pool.free = *static_cast<void **>(memory);
+        ++pool.recycled;
+        return memory;
+    }
+    if (static_cast<std::size_t>(pool.limit - pool.top) < rounded) {
+        pool.top = static_cast<char *>(::operator new(poolChunk));
+        pool.limit = pool.top + poolChunk / rounded * rounded;
+        ++pool.chunks;
+    }
+    void *memory = pool.top;
+    pool.top += rounded;
+    return memory;
+}
+
+void freeSmall(void *memory, std::size_t size)
+{
+    if (size > largestPooled) return ::operator delete(memory);
+
+    Pool& pool = heap().pools[(size + sizeClass - 1) / sizeClass - 1];
+    *static_cast<void **>(memory) = pool.free;
+    pool.free = memory;
+}
+
+void *HeapObject::operator new(std::size_t size)
+{
+    auto& h = heap();
+    void *memory = allocateSmall(size);
+    h.bytes += size;
+    h.allocated += size;
+    noteAllocation(h);
+    return memory;
+}
+
+void HeapObject::operator delete(void *object, std::size_t size)
+{
+    heap().bytes -= size;
+    freeSmall(object, size);
+}
+
+// Nothing on the heap can refer to a frame whose function makes no
+// closures, but something may still hold another handle to it. If not,
+// and it was the last object registered, it comes off the end of
+// objects, and its memory goes back to its pool for the next call's
+// frame. Calls return in the reverse order they were made, so this is
+// usually the case.
+void releaseFrame(EnvPointer& frame)
+{
+    auto& h = heap();
+    SchemeEnvironment *env = frame.get();
+    bool unshared = env->rootCount == 1 && env->space == Space::Young
+        && h.objects.back() == env;
+    frame = EnvPointer();
+    if (!unshared) return;
+
+    h.allocated -= std::min(h.allocated, sizeof(SchemeEnvironment));
+    ++h.framesReleased;
+    delete env;
+}
+
+// Objects are registered by their HeapObject constructor rather than
+// in operator new because a function's HeapObject part doesn't start
+// at the allocation: its vtable pointer comes first.
+void registerObject(HeapObject *object)
+{
+    heap().objects.push_back(object);
+}
+
+// Outside a sweep this is only reached when a constructor throws, and
+// the object is forgotten again. It's usually the last one registered.
+HeapObject::~HeapObject()
+{
+    auto& h = heap();
+    if (!h.sweeping) {
+        auto found = std::find(h.objects.rbegin(), h.objects.rend(), this);
+        if (found != h.objects.rend()) h.objects.erase(found.base() - 1);
+    }
+}
+
+void shade(HeapObject *object)
+{
+    heap().marker.mark(object);
+}
+
+void remember(HeapObject *object)
+{
+    object->remembered = true;
+    heap().remembered.push_back(object);
+}
+
+void *refillNursery(std::size_t size)
+{
+    auto& h = heap();
+    closeNursery(h);
+
+    Block *block = takeBlock(h);
+    block->live = 0;
+    h.nursery.push_back(block);
+    h.allocated += blockSize;
+    noteAllocation(h);
+
+    nursery.top = block->memory + size;
+    nursery.limit = block->memory + blockSize;
+    return block->memory;
+}
+
+HeapObject *Tracer::evacuate(HeapObject *object)
+{
+    // A pair that has already been moved holds its new address in car
+    auto pair = static_cast<SchemeCons *>(object);
+    if (pair->marked) return pair->car.object();
+
+    auto& h = heap();
+    auto copy = ::new (allocatePair(h))
+        SchemeCons(pair->car, pair->cdr, Space::Old);
+    pair->marked = true;
+    pair->car = HeapExpr(copy);
+    pending.push_back(copy);
+    ++evacuated;
+
+    // Marking began before the copy existed, so it's kept and traced
+    if (h.phase == Phase::Marking) {
+        copy->marked = true;
+        h.marker.scan(copy);
+    }
+    return copy;
+}
+
+// Rather than erasing each chunk from the front of the stack, which
+// would make dealing out a large root set quadratic, share moves the
+// bottom of the stack up past it, and only closes the gap once it is
+// larger than what is left above it.
+void Tracer::share(std::vector<HeapObject *>& chunk, std::size_t count)
+{
+    auto begin = pending.begin() + bottom;
+    auto end = begin + std::min(count, pendingCount());
+    chunk.assign(begin, end);
+    bottom = end - pending.begin();
+    if (bottom == pending.size()) {
+        pending.clear();
+        bottom = 0;
+    } else if (bottom > pending.size() - bottom) {
+        pending.erase(pending.begin(), pending.begin() + bottom);
+        bottom = 0;
+    }
+}
+
+void Tracer::adopt(const std::vector<HeapObject *>& chunk)
+{
+    pending.insert(pending.end(), chunk.begin(), chunk.end());
+}
+
+bool Tracer::drain(std::size_t limit)
+{
+    for (; pending.size() != bottom && limit; --limit) {
+        HeapObject *object = pending.back();
+        pending.pop_back();
+        trace(object, *this);
+    }
+    if (pending.size() == bottom) {
+        pending.clear();
+        bottom = 0;
+    }
+    return pending.empty();
+}
+
+void SchemeEnvironment::trace(Tracer& tracer)
+{
+    for (auto& slot : slots) tracer.mark(slot);
+    tracer.mark(outer);
+}
+
+// The pause target bounds the slice of a major collection, which comes
+// after the minor one; how long that takes depends on how much survives
+// the nursery. A major collection that can't keep up is finished in one
+// pause once the heap is twice the size that started it.
+void collectPending()
+{
+    auto& h = heap();
+    timed(h, [&h] {
+        std::size_t freed = collectYoung(h);
+        if (h.phase == Phase::Idle && h.bytes >= h.threshold) {
+            startMarking(h);
+        }
+        auto deadline = sliceDeadline(h);
+        if (h.bytes >= 2 * h.threshold) deadline = Clock::time_point::max();
+        return freed + collectOld(h, deadline);
+    });
+}
+
+Region::Region()
+{
+    collectPending();
+    ++heap().regions;
+}
+
+// Closing a region is a minor collection like any other, taking time
+// in proportion to what the region allocated.
+Region::~Region()
+{
+    auto& h = heap();
+    --h.regions;
+    ++h.regionsClosed;
+    collectPending();
+}
+
+std::size_t collectGarbage()
+{
+    auto& h = heap();
+    return timed(h, [&h] { return collectYoung(h) + collectAll(h); });
+}
+
+void setPauseTarget(double seconds)
+{
+    heap().pauseTarget = seconds;
+}
+
+void startCollection()
+{
+    auto& h = heap();
+    if (h.phase != Phase::Idle) return;
+    timed(h, [&h] {
+        std::size_t freed = collectYoung(h);
+        startMarking(h);
+        return freed + collectOld(h, sliceDeadline(h));
+    });
+}
+
+bool collectionInProgress()
+{
+    return heap().phase != Phase::Idle;
+}
+
+void setMarkThreads(unsigned threads)
+{
+    heap().markThreads = threads;
+}
+
+void resetPauseStats()
+{
+    auto& h = heap();
+    h.pauses.clear();
+    h.pauseCount = 0;
+    h.longestPauseSeconds = 0;
+}
+
+HeapStats heapStats()
+{
+    auto& h = heap();
+    std::size_t objects = h.objects.size() - (h.sweepNext - h.sweepLive);
+    std::size_t blocks = h.nursery.size() + h.retained.size();
+    for (auto block : h.retained) objects += block->live;
+    for (auto block : h.pairs) objects += block->live;
+    for (auto block : h.nursery) {
+        char *end = block == h.nursery.back() ? nursery.top : block->end;
+        objects += (end - block->memory) / sizeof(SchemeCons);
+    }
+    return { objects, h.bytes + blocks * blockSize, h.collections,
+             h.minorCollections, h.freed, h.promoted, h.pauseSeconds,
+             h.longestPauseSeconds, percentile(h.pauses, 0.5),
+             percentile(h.pauses, 0.9), percentile(h.pauses, 0.99),
+             h.markSeconds, h.compactions, h.framesReleased,
+             h.regionsClosed };
+}
+
+std::vector<PoolStats> poolStats()
+{
+    auto& h = heap();
+    std::vector<PoolStats> stats;
+    for (std::size_t i = 0; i != largestPooled / sizeClass; ++i) {
+        const Pool& pool = h.pools[i];
+        if (pool.allocations) {
+            stats.push_back({ (i + 1) * sizeClass, pool.allocations,
+                              pool.recycled, pool.chunks });
+        }
+    }
+    return stats;
+}
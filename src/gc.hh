@@ -0,0 +1,225 @@
+#ifndef GC_HH
+#define GC_HH
+
+#include <cstddef>
+#include <limits>
+#include <vector>
+#include "scheme_types.hh"
+
+// Build with -DGC_STRESS=1 to collect the nursery at every safe point,
+// which quickly shows up a missing root or write barrier.
+#ifndef GC_STRESS
+#define GC_STRESS 0
+#endif
+
+// Heap objects are owned by a generational collector. Most objects die
+// young, so a minor collection only traces those allocated since the
+// last one. Pairs, the most numerous, are bump-allocated in a nursery,
+// and a minor collection copies the few that are still reachable out
+// of it, leaving it empty again; other young objects that survive stay
+// where they are. Pairs that are roots can only be found by looking at
+// them, though, so a minor collection reads the rootCount of every pair
+// allocated since the last one: its cost grows with the number of pairs
+// allocated, garbage included, not just with the survivors. A major
+// collection marks and sweeps everything, so cycles through pairs,
+// environments and closures are reclaimed like anything else.
+//
+// The roots are the objects with a non-zero rootCount: those referred
+// to by a SchemeExpr or Handle outside the heap, such as the evaluator's
+// locals, the VM's stacks, compiled constants and the symbol table.
+// References between heap objects are HeapExprs and raw pointers, which
+// the collector finds by tracing. Since the collector knows how many
+// roots refer to an object but not where they are, it can't move a
+// pair that is a root; such pairs are pinned in their nursery block,
+// and the whole block, 32 KiB, is kept until the last of them dies.
+//
+// Collections only happen at safe points, where every live value is
+// known to be rooted: allocation just notes that one is due.
+//
+// A major collection can also be made incrementally, so that a large
+// heap doesn't stop the program for long. Marking then starts from a
+// snapshot of the roots taken after a minor collection, and the rest of
+// the marking and the sweep are done in slices, one at each minor
+// collection, each bounded by a pause target. The write barrier shades
+// every reference the program overwrites in the meantime, so what was
+// reachable when marking began is still marked however the program
+// moves it around, and pairs and objects that survive the nursery while
+// marking is underway are marked when they leave it. Objects that
+// become garbage during a collection are freed by the next one.
+//
+// A major collection made in one pause marks a large heap in parallel,
+// on a pool of threads that steal work from each other. Once it has
+// marked, if most of the old pair space is free, it compacts the space
+// by copying the live pairs out of the sparsest blocks and updating
+// every reference to them, so the blocks can be freed. Other objects,
+// whose strings and slot vectors may be large, are never moved.
+
+// Traces objects and the objects reachable from them. The pending
+// objects are kept on an explicit stack, so long lists and deep
+// environment chains don't recurse.
+//
+// In a major collection the tracer marks what it reaches outside the
+// nursery generation. In a minor collection it only traces Young
+// objects, and evacuates each Young pair it reaches out of the nursery
+// instead of marking it, updating the field that referred to it. After
+// a compaction it only updates the fields that refer to Moved pairs.
+class Tracer {
+public:
+    enum Mode { Marking, Evacuating, Forwarding };
+private:
+    std::vector<HeapObject *> pending;
+    std::size_t bottom = 0;     // of pending, below which has been shared
+    Mode mode;
+    std::size_t evacuated = 0;
+
+    HeapObject *evacuate(HeapObject *object);
+public:
+    explicit Tracer(Mode mode = Marking) : mode(mode) {}
+
+    void mark(HeapExpr& field) {
+        if (!field.isPointer()) return;
+        HeapObject *object = field.object();
+        if (object->heapType != HeapType::Cons) {
+            mark(object);
+        } else if (mode == Forwarding) {
+            if (object->space == Space::Moved) {
+                field = static_cast<SchemeCons *>(object)->car;
+            }
+        } else if (mode == Evacuating && object->space == Space::Young) {
+            field = HeapExpr(evacuate(object));
+        } else {
+            mark(object);
+        }
+    }
+
+    // Raw pointers between heap objects never refer to pairs. Setting
+    // the mark is atomic, so that tracers on other threads can mark
+    // the same heap, and only one of them traces each object.
+    void mark(HeapObject *object) {
+        if (object && mode != Forwarding
+            && (mode == Evacuating) == (object->space == Space::Young)
+            && !object->marked.load(std::memory_order_relaxed)
+            && !object->marked.exchange(true, std::memory_order_relaxed)) {
+            pending.push_back(object);
+        }
+    }
+
+    // Traces object's fields without marking it.
+    void scan(HeapObject *object) {
+        pending.push_back(object);
+    }
+
+    // Traces up to limit of the pending objects, returning whether
+    // there are none left.
+    bool drain(std::size_t limit = std::numeric_limits<std::size_t>::max());
+
+    std::size_t pendingCount() const { return pending.size() - bottom; }
+
+    // Moves up to count of the pending objects, those that have been
+    // pending longest, into chunk, so another tracer can adopt them.
+    void share(std::vector<HeapObject *>& chunk, std::size_t count);
+    void adopt(const std::vector<HeapObject *>& chunk);
+
+    std::size_t evacuatedCount() const { return evacuated; }
+};
+
+struct HeapStats {
+    std::size_t objects;        // live after the last collection, plus new
+    std::size_t bytes;          // objects plus the blocks pairs live in
+    std::size_t collections;    // major collections
+    std::size_t minorCollections;
+    std::size_t freed;          // objects freed by the last collection
+    std::size_t promoted;       // pairs ever moved out of the nursery
+    double pauseSeconds;        // total time spent collecting
+    double longestPauseSeconds;
+    double medianPauseSeconds;  // of the most recent pauses
+    double pause90Seconds;      // 90th percentile of the same
+    double pause99Seconds;
+    double markSeconds;         // total time major collections spent marking
+    std::size_t compactions;    // of the old pair space
+    std::size_t framesReleased; // freed as their calls returned
+    std::size_t regions;        // closed
+};
+
+// The allocations made from one of the pools small objects come from.
+struct PoolStats {
+    std::size_t size;           // of the objects in the pool
+    std::size_t allocations;
+    std::size_t recycled;       // that reused a freed object
+    std::size_t chunks;         // allocated from the system
+};
+
+// Set once enough has been allocated since the last collection that
+// the next safe point should collect.
+extern bool collectionDue;
+
+// Collects the young objects, and everything if enough have survived
+// since the last major collection.
+void collectPending();
+
+// Directs what is allocated while it is open into a region that is
+// freed when it closes, for work such as handling a request, after
+// which almost everything it allocated is garbage. The region is the
+// nursery: opening one collects it, and minor collections then wait
+// until the region closes, unless it allocates so much that they can't.
+// Closing it collects the nursery again. What has escaped, by being
+// rooted or stored in an older object such as the global environment,
+// is moved out or promoted, and everything else is freed. That is an
+// ordinary minor collection, not a pointer reset: it reads every pair
+// the region allocated and frees its other objects one by one, so it
+// takes time proportional to what the region allocated. What a region
+// saves is the minor collections that would otherwise have copied its
+// short-lived data while it was still live. Open and close regions
+// only at safe points.
+class Region {
+public:
+    Region();
+    ~Region();
+
+    Region(const Region&) = delete;
+    Region& operator=(const Region&) = delete;
+};
+
+// Collects everything now, returning the number of objects freed.
+std::size_t collectGarbage();
+
+// Sets how long, in seconds, a slice of a major collection should aim
+// to pause the program for, on top of the minor collection it follows.
+// Zero, the default, makes each major collection in one pause;
+// otherwise they are incremental, and each slice stops once the target
+// is reached. A slice always makes some progress, and if the program
+// allocates faster than the slices keep up with, the collection is
+// finished in one pause rather than letting the heap grow unbounded.
+void setPauseTarget(double seconds);
+
+// Begins an incremental major collection now rather than waiting until
+// one is due, for instance while the program is idle.
+void startCollection();
+
+bool collectionInProgress();
+
+// Sets how many threads mark the heap in a major collection made in one
+// pause, counting the one collecting. Zero, the default, means one for
+// each core.
+void setMarkThreads(unsigned threads);
+
+// Forgets the pauses so far, so that the percentiles and the longest
+// pause in heapStats describe only those from now on.
+void resetPauseStats();
+
+HeapStats heapStats();
+
+// One entry for each pool that has been allocated from, smallest first.
+std::vector<PoolStats> poolStats();
+
+// Frees a function's frame as its call returns, if it can tell nothing
+// else refers to it. The caller must know that no closure was made in
+// the frame. Resets frame either way.
+void releaseFrame(EnvPointer& frame);
+
+inline void safePoint()
+{
+    if (GC_STRESS || collectionDue) collectPending();
+}
+
+#endif
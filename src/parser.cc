@@ -3,7 +3,6 @@
 #include <string>
 #include <sstream>
 #include <vector>
-#include <boost/variant.hpp>
 #include "parser.hh"
 #include "scheme_types.hh"
 
@@ -148,11 +147,11 @@ std::istream& readMacroQuoteForm(std::istream& in, const std::string& token,
     SchemeExpr expr;
     if (readSchemeExpr(in, expr)) {
         SchemeExpr sym;
-        if (token == "'")       sym = SchemeSymbol("quote");
-        else if (token == "`")  sym = SchemeSymbol("quasiquote");
-        else if (token == ",")  sym = SchemeSymbol("unquote");
-        else if (token == ",@") sym = SchemeSymbol("unquote-splicing");
-        out = consFromVector(std::vector<SchemeExpr>{ sym, expr });
+        if (token == "'")       sym = intern("quote");
+        else if (token == "`")  sym = intern("quasiquote");
+        else if (token == ",")  sym = intern("unquote");
+        else if (token == ",@") sym = intern("unquote-splicing");
+        out = cons(sym, cons(expr, SchemeExpr(Nil::Nil)));
     }
     return in;
 }
@@ -209,7 +208,7 @@ std::istream& readSchemeExpr(std::istream& in, SchemeExpr& out)
         if (readString(in, string)) out = string;
         else throw scheme_error("Unclosed string literal");
     } else {
-        out = SchemeSymbol{token};
+        out = intern(token);
     }
 
     return in;
@@ -12,9 +12,9 @@ std::istream& readSchemeExpr(std::istream& in, SchemeExpr& out);
 
 inline char charValue(const SchemeExpr& e)
 {
-    try {
-        return boost::get<char>(e);
-    } catch (const boost::bad_get&){
+    if (e.isCharacter()) {
+        return e.character();
+    } else {
         std::ostringstream error;
         error << "Character expected, got " << e;
         throw scheme_error(error);
@@ -23,31 +23,35 @@ inline char charValue(const SchemeExpr& e)
 
 inline int intValue(const SchemeExpr& e)
 {
-    try {
-        return boost::get<int>(e);
-    } catch (const boost::bad_get&) {
+    if (e.isFixnum()) {
+        return e.fixnum();
+    } else {
         std::ostringstream error;
         error << "Integer expected, got " << e;
         throw scheme_error(error);
     }
 }
 
-inline std::string stringValue(const SchemeExpr& e)
+// stringValue, symbolValue and functionPointer borrow what they return
+// from e's heap object rather than copying it, so it is valid as long
+// as e or another root refers to the object.
+
+inline const std::string& stringValue(const SchemeExpr& e)
 {
-    try {
-        return boost::get<std::string>(e);
-    } catch (const boost::bad_get&) {
+    if (e.isString()) {
+        return asString(e);
+    } else {
         std::ostringstream error;
         error << "String expected, got " << e;
         throw scheme_error(error);
     }
 }
 
-inline SchemeSymbol symbolValue(const SchemeExpr& e)
+inline const SchemeSymbol& symbolValue(const SchemeExpr& e)
 {
-    try {
-        return boost::get<SchemeSymbol>(e);
-    } catch (const boost::bad_get&) {
+    if (e.isSymbol()) {
+        return asSymbol(e);
+    } else {
         std::ostringstream error;
         error << "Symbol expected, got " << e;
         throw scheme_error(error);
@@ -56,20 +60,20 @@ inline SchemeSymbol symbolValue(const SchemeExpr& e)
 
 inline bool boolValue(const SchemeExpr& e)
 {
-    try {
-        return boost::get<bool>(e);
-    } catch (const boost::bad_get&) {
+    if (e.isBoolean()) {
+        return e.boolean();
+    } else {
         std::ostringstream error;
         error << "Boolean expected, got " << e;
         throw scheme_error(error);
     }
 }
 
-inline std::shared_ptr<SchemeFunction> functionPointer(const SchemeExpr& e)
+inline SchemeFunction *functionPointer(const SchemeExpr& e)
 {
-    try {
-        return boost::get<std::shared_ptr<SchemeFunction>>(e);
-    } catch (const boost::bad_get&) {
+    if (e.isFunction()) {
+        return asFunction(e);
+    } else {
         std::ostringstream error;
         error << "Function expected, got " << e;
         throw scheme_error(error);
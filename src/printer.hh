@@ -4,20 +4,30 @@
 #include <memory>
 #include <sstream>
 #include <string>
-#include <boost/variant.hpp>
+#include <unordered_set>
 #include "scheme_types.hh"
 
-class stringVisitor : public boost::static_visitor<SchemeExpr> {
-    std::ostringstream& os;
+// Writes the printed representation of a value to a stream. A list is
+// written a pair at a time, its elements going straight into the same
+// stream. set-car! and set-cdr! can make a list contain itself, so the
+// visitor keeps the pairs of the lists it is inside in path, and
+// writes "..." for a pair already there rather than looping forever.
+// Structure that is merely shared, not cyclic, is written in full.
+class printVisitor {
+    std::ostream& os;
+    std::unordered_set<const SchemeCons *>& path;
 public:
-    stringVisitor(std::ostringstream& os) : os(os) {}
+    typedef void result_type;
 
-    std::string operator()(bool b) const {
+    printVisitor(std::ostream& os,
+                 std::unordered_set<const SchemeCons *>& path)
+        : os(os), path(path) {}
+
+    void operator()(bool b) const {
         os << (b ? "#t" : "#f");
-        return os.str();
     }
 
-    std::string operator()(char c) const {
+    void operator()(char c) const {
         os << "#\\";
         switch (c) {
         case ' ':  os << "Space";   break;
@@ -25,66 +35,73 @@ public:
         case '\t': os << "Tab";     break;
         default: os << c; break;
         }
-        return os.str();
     }
 
-    std::string operator()(int i) const {
+    void operator()(int i) const {
         os << i;
-        return os.str();
     }
 
-    std::string operator()(const std::string& string) const {
+    void operator()(const std::string& string) const {
         os << '"';
         for (char c : string) {
             if (c == '"') os << "\\\"";
             else os << c;
         }
         os << '"';
-        return os.str();
     }
 
-    std::string operator()(const SchemeSymbol& symbol) const {
+    void operator()(const SchemeSymbol& symbol) const {
         os << symbol.string;
-        return os.str();
     }
 
-    std::string operator()(const std::shared_ptr<SchemeFunction>&) const {
+    void operator()(SchemeFunction *) const {
         os << "<function>";
-        return os.str();
     }
 
-    std::string operator()(const Nil&) const {
+    void operator()(const Nil&) const {
         os << "()";
-        return os.str();
     }
 
-    std::string operator()(SchemeCons cons) const {
+    void operator()(const SchemeCons *cons) const {
+        if (path.count(cons)) {
+            os << "...";
+            return;
+        }
+        const SchemeCons *first = cons;
         os << "(";
         for (;;) {
-            os << car(cons);
-            if (SchemeExpr(Nil::Nil) == cdr(cons)) {
+            path.insert(cons);
+            applyVisitor(*this, car(cons));
+            const HeapExpr& rest = cdr(cons);
+            if (rest.isNil()) {
                 break;
-            } else {
-                os << " ";
-            }
-            try {
-                cons = consValue(cdr(cons));
-            } catch (const scheme_error&) {
-                os << ". " << cdr(cons);
+            } else if (!rest.isCons()) {
+                os << " . ";
+                applyVisitor(*this, rest);
+                break;
+            } else if (path.count(asCons(rest))) {
+                os << " ...";
                 break;
             }
+            os << " ";
+            cons = asCons(rest);
         }
         os << ")";
-        return os.str();
+        for (;; first = asCons(cdr(first))) {
+            path.erase(first);
+            if (first == cons) break;
+        }
     }
 };
 
-inline std::ostream& operator<<(std::ostream& os, const SchemeExpr& e)
+inline std::ostream& operator<<(std::ostream& os, const ExprWord& e)
 {
-    // This and the list case in stringVisitor don't use symbolValue()
+    // Printed into a string first, so that a field width set on os
+    // applies to the whole value. The visitor doesn't use symbolValue()
     // to avoid a circular dependency with parser.hh
     std::ostringstream ss;
-    boost::apply_visitor(stringVisitor(ss), e);
+    std::unordered_set<const SchemeCons *> path;
+    applyVisitor(printVisitor(ss, path), e);
     return os << ss.str();
 }
 
@@ -1,14 +1,44 @@
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include "compiler.hh"
 #include "eval.hh"
 #include "builtins.hh"
+#include "gc.hh"
 #include "parser.hh"
 #include "scheme_types.hh"
+#include "vm.hh"
 
 int main(int argc, char **argv)
 {
     auto env = standardEnvironment();
+    bool showBytecode = false;
+
+    // --vm runs everything on the bytecode VM; --disassemble also lists
+    // the bytecode for each expression typed at the prompt,
+    // --max-depth=N limits how deeply the VM lets calls nest,
+    // --pause-target=US makes major collections incremental, aiming to
+    // pause for no more than US microseconds at a time, and
+    // --mark-threads=N sets how many threads mark the heap.
+    for (; argc > 1 && std::strncmp(argv[1], "--", 2) == 0; --argc, ++argv) {
+        if (std::strcmp(argv[1], "--vm") == 0) {
+            setEvalMode(EvalMode::Bytecode);
+        } else if (std::strncmp(argv[1], "--max-depth=", 12) == 0) {
+            setMaxCallDepth(std::strtoul(argv[1] + 12, nullptr, 10));
+        } else if (std::strncmp(argv[1], "--pause-target=", 15) == 0) {
+            setPauseTarget(std::strtod(argv[1] + 15, nullptr) / 1e6);
+        } else if (std::strncmp(argv[1], "--mark-threads=", 15) == 0) {
+            setMarkThreads(std::strtoul(argv[1] + 15, nullptr, 10));
+        } else if (std::strcmp(argv[1], "--disassemble") == 0) {
+            setEvalMode(EvalMode::Bytecode);
+            showBytecode = true;
+        } else {
+            std::cerr << "error: unknown option " << argv[1] << std::endl;
+            return 1;
+        }
+    }
 
     while (--argc) {
         std::ifstream file(*++argv);
@@ -28,6 +58,7 @@ int main(int argc, char **argv)
             std::cout << " * " << std::flush;
             SchemeExpr expr;
             if (readSchemeExpr(std::cin, expr)) {
+                if (showBytecode) disassemble(std::cout, *compile(expr));
                 std::cout << eval(expr, env) << std::endl;
             }
         } catch (const scheme_error& e) {
@@ -1,50 +1,185 @@
+#include <unordered_map>
 #include <vector>
+#include "printer.hh"
 #include "scheme_types.hh"
 
+SchemeExpr::SchemeExpr(const char *string)
+    : SchemeExpr(std::string(string))
+{}
+
+SchemeExpr::SchemeExpr(const std::string& string)
+    : SchemeExpr(static_cast<HeapObject *>(new StringObject(string)))
+{}
+
+SchemeExpr::SchemeExpr(const SchemeSymbol *symbol)
+    : SchemeExpr(static_cast<HeapObject *>(const_cast<SchemeSymbol *>(symbol)))
+{}
+
+SchemeExpr::SchemeExpr(SchemeCons *cons)
+    : SchemeExpr(static_cast<HeapObject *>(cons))
+{}
+
+SchemeExpr::SchemeExpr(SchemeFunction *function)
+    : SchemeExpr(static_cast<HeapObject *>(function))
+{}
+
+void destroyHeapObject(HeapObject *object)
+{
+    switch (object->heapType) {
+    case HeapType::String:
+        delete static_cast<StringObject *>(object);
+        break;
+    case HeapType::Symbol:
+        break;                  // owned by the symbol table
+    case HeapType::Cons:
+        break;                  // freed with the collector's blocks
+    case HeapType::Environment:
+        delete static_cast<SchemeEnvironment *>(object);
+        break;
+    case HeapType::Function:
+    case HeapType::Lexical:
+    case HeapType::Closure:
+        delete static_cast<SchemeFunction *>(object);
+        break;
+    }
+}
+
+namespace {
+
+struct SymbolTable {
+    std::unordered_map<std::string, SchemeSymbol *> byName;
+    std::size_t stringBytes = 0;
+};
+
+SymbolTable& symbolTable()
+{
+    static SymbolTable table;
+    return table;
+}
+
+Keyword keywordNamed(const std::string& name)
+{
+    static const std::unordered_map<std::string, Keyword> keywords{
+        { "and",              Keyword::And },
+        { "begin",            Keyword::Begin },
+        { "define",           Keyword::Define },
+        { "if",               Keyword::If },
+        { "lambda",           Keyword::Lambda },
+        { "or",               Keyword::Or },
+        { "quasiquote",       Keyword::Quasiquote },
+        { "quote",            Keyword::Quote },
+        { "set!",             Keyword::Set },
+        { "unquote",          Keyword::Unquote },
+        { "unquote-splicing", Keyword::UnquoteSplicing }
+    };
+    auto found = keywords.find(name);
+    return found == keywords.end() ? Keyword::None : found->second;
+}
+
+} // end namespace
+
+const SchemeSymbol *intern(const std::string& name)
+{
+    auto& table = symbolTable();
+    auto found = table.byName.find(name);
+    if (found != table.byName.end()) return found->second;
+
+    auto symbol = new SchemeSymbol(name, table.byName.size(),
+                                   keywordNamed(name));
+    symbol->rootCount = 1;      // the table's reference; never released
+    table.byName.emplace(name, symbol);
+    table.stringBytes += 2 * name.capacity();   // key and symbol copies
+    return symbol;
+}
+
+SymbolTableStats symbolTableStats()
+{
+    typedef std::pair<const std::string, SchemeSymbol *> Entry;
+    const auto& table = symbolTable();
+    std::size_t count = table.byName.size();
+    std::size_t bytes = table.stringBytes
+        + count * (sizeof(SchemeSymbol) + sizeof(Entry) + sizeof(void *))
+        + table.byName.bucket_count() * sizeof(void *);
+    return { count, bytes };
+}
+
+bool operator==(const ExprWord& lhs, const ExprWord& rhs)
+{
+    const ExprWord *x = &lhs;
+    const ExprWord *y = &rhs;
+
+    // Compare cars recursively but walk cdrs in a loop, so comparing
+    // long lists doesn't use stack proportional to their length
+    for (;;) {
+        if (x->raw() == y->raw()) return true;
+        if (!x->isPointer() || !y->isPointer()) return false;
+
+        HeapType type = x->object()->heapType;
+        if (type != y->object()->heapType) return false;
+
+        switch (type) {
+        case HeapType::String:
+            return asString(*x) == asString(*y);
+        case HeapType::Symbol:
+        case HeapType::Environment:
+        case HeapType::Function:
+        case HeapType::Lexical:
+        case HeapType::Closure:
+            return false;       // identical objects are caught by raw()
+        case HeapType::Cons:
+            if (car(asCons(*x)) != car(asCons(*y))) return false;
+            x = &cdr(asCons(*x));
+            y = &cdr(asCons(*y));
+            break;
+        }
+    }
+}
+
+bool operator!=(const ExprWord& lhs, const ExprWord& rhs)
+{
+    return !(lhs == rhs);
+}
+
 SchemeEnvironment::SchemeEnvironment(
-    const std::vector<SchemeSymbol>& params,
-    const std::vector<SchemeExpr>& args,
+    std::size_t frameSize,
+    std::size_t paramCount,
+    const SchemeExpr *args,
+    std::size_t argCount,
     bool hasRestParam,
-    std::shared_ptr<SchemeEnvironment> outer)
-    : outer(outer)
+    SchemeEnvironment *outer)
+    : HeapObject(HeapType::Environment), outer(outer)
 {
-    if (!hasRestParam && params.size() != args.size()) {
+    if (!hasRestParam && paramCount != argCount) {
         std::ostringstream error;
-        error << "Function expected " << params.size() << " arguments, ";
-        error << "passed " << args.size();
+        error << "Function expected " << paramCount << " arguments, ";
+        error << "passed " << argCount;
         throw scheme_error(error);
     }
 
-    if (hasRestParam && params.size() - 1 > args.size()) {
+    if (hasRestParam && paramCount - 1 > argCount) {
         std::ostringstream error;
-        error << "Function expected at least " << params.size() - 1;
-        error << " arguments, passed " << args.size();
+        error << "Function expected at least " << paramCount - 1;
+        error << " arguments, passed " << argCount;
         throw scheme_error(error);
     }
 
-    if (hasRestParam && args.empty()) {
-        // The rest param has to be the only one, as we've already
-        // checked we have enough required args
-        definitions[params[0].string] = SchemeExpr(Nil::Nil);
-    } else {
-        for (std::size_t i = 0; i < params.size(); ++i) {
-            definitions[params[i].string] = args[i];
-        }
-    }
+    std::size_t required = hasRestParam ? paramCount - 1 : paramCount;
+    slots.reserve(frameSize);
+    slots.assign(args, args + required);
 
     if (hasRestParam) {
-        std::vector<SchemeExpr> rest(args.begin() + params.size() - 1,
-                                     args.end());
-        if (rest.empty()) {
-            definitions[params[params.size() - 1].string] = Nil::Nil;
+        if (argCount == required) {
+            slots.push_back(SchemeExpr(Nil::Nil));
         } else {
-            definitions[params[params.size() - 1].string] =
-                consFromVector(rest);
+            SchemeArgs rest(args + required, argCount - required);
+            slots.push_back(consFromVector(rest));
         }
     }
+
+    slots.resize(frameSize, SchemeExpr::unbound());
 }
 
-std::vector<SchemeExpr> vectorFromCons(SchemeCons cons)
+std::vector<SchemeExpr> vectorFromCons(const SchemeCons *cons)
 {
     std::vector<SchemeExpr> v;
 
@@ -57,26 +192,60 @@ std::vector<SchemeExpr> vectorFromCons(SchemeCons cons)
     return v;
 }
 
-SchemeCons consFromVector(const std::vector<SchemeExpr>& vector) {
-    if (vector.empty()) {
-        throw std::runtime_error("Can't convert empty vector to cons");
+std::size_t listLength(const ExprWord& list)
+{
+    std::size_t length = 0;
+    for (const ExprWord *rest = &list; !rest->isNil();
+         rest = &cdr(consValue(*rest))) {
+        ++length;
+    }
+    return length;
+}
+
+namespace {
+
+// Builds a list front to back, so that its pairs are allocated, and so
+// lie next to each other in the nursery, in list order. The pairs are
+// linked without a write barrier: they are all Young, and nothing can
+// collect them before the next safe point.
+class ListBuilder {
+    SchemeExpr head;
+    SchemeCons *last = nullptr;
+public:
+    void push_back(const ExprWord& value) {
+        auto pair = new SchemeCons(value, SchemeExpr(Nil::Nil));
+        if (last) last->cdr = HeapExpr(pair);
+        else head = pair;
+        last = pair;
+    }
+
+    SchemeExpr finish(const ExprWord& tail) {
+        last->cdr = tail;
+        return head;
     }
+};
 
-    SchemeCons cons{ vector.back(), SchemeExpr(Nil::Nil) };
-    SchemeCons prev;
-    for (auto it = vector.rbegin() + 1; it != vector.rend(); ++it) {
-        prev = { *it, cons };
-        cons = prev;
+} // end namespace
+
+SchemeExpr consFromVector(const SchemeArgs& elements) {
+    if (elements.empty()) {
+        throw std::runtime_error("Can't convert empty vector to cons");
     }
 
-    return cons;
+    ListBuilder list;
+    for (auto& element : elements) list.push_back(element);
+    return list.finish(SchemeExpr(Nil::Nil));
 }
 
 SchemeExpr append(const SchemeExpr& x, SchemeExpr y)
 {
-    auto xVec = vectorFromExpr(x);
-    for (auto it = xVec.crbegin(); it != xVec.rend(); ++it) {
-        y = SchemeCons(*it, y);
+    if (x.isNil()) return y;
+
+    ListBuilder list;
+    for (const ExprWord *rest = &x; !rest->isNil(); ) {
+        SchemeCons *pair = consValue(*rest);
+        list.push_back(car(pair));
+        rest = &cdr(pair);
     }
-    return y;
+    return list.finish(y);
 }
@@ -1,40 +1,487 @@
 #ifndef SCHEME_HH
 #define SCHEME_HH
 
+#include <atomic>
+#include <cstdint>
 #include <deque>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <sstream>
 #include <string>
+#include <utility>
 #include <vector>
-#include <boost/variant.hpp>
 
+struct SchemeCons;
 struct SchemeFunction;
+class SchemeExpr;
+class Tracer;
 
 enum class Nil { Nil };
 
-struct SchemeSymbol {
-    std::string string;
+// Every value that doesn't fit in an immediate lives on the heap
+// behind a HeapObject header, and is owned by the garbage collector in
+// gc.cc. The header carries the object's type, where it lives, the
+// collector's mark and remembered bits, and a count of the SchemeExprs
+// and Handles outside the heap that refer to the object: the roots the
+// collector traces from.
+//
+// Functions made by lambda get their own types, Lexical for the tree
+// evaluator and Closure for the VM, so each evaluator can recognise its
+// own functions and call them without going through
+// SchemeFunction::operator(). The function types come last, so
+// isFunction() is a single comparison.
+enum class HeapType : std::uint8_t {
+    String, Symbol, Cons, Environment, Function, Lexical, Closure
+};
+
+// Objects start out Young and become Old if they survive a minor
+// collection. Pairs are allocated in the nursery and moved out of it
+// into the blocks of the old pair space when they survive, except that
+// a pair that is a root then can't be moved, so it becomes Pinned where
+// it is. Free marks a slot in a block that holds no live pair, and
+// Moved one whose pair a compaction has copied elsewhere, leaving the
+// new address in its car until every reference has been updated.
+enum class Space : std::uint8_t { Young, Old, Pinned, Free, Moved };
+
+struct HeapObject;
+void registerObject(HeapObject *object);
+
+struct HeapObject {
+    HeapType heapType;
+    Space space;
+    std::atomic<bool> marked;   // set by tracers marking in parallel
+    bool remembered;            // may refer to Young pairs
+    std::uint32_t rootCount;
+
+    // Objects other than pairs are always allocated with new, which
+    // accounts for their size; construction registers them with the
+    // collector. Pairs live in blocks the collector keeps track of.
+    static void *operator new(std::size_t size);
+    static void operator delete(void *object, std::size_t size);
+
+    HeapObject(const HeapObject&) = delete;
+    HeapObject& operator=(const HeapObject&) = delete;
+
+protected:
+    HeapObject(HeapType heapType, Space space = Space::Young)
+        : heapType(heapType), space(space), marked(false),
+          remembered(false), rootCount(0)
+    {
+        if (heapType != HeapType::Cons) registerObject(this);
+    }
+
+    ~HeapObject();
+};
+
+// Frees an Old object the collector found unreachable.
+void destroyHeapObject(HeapObject *object);
+
+// Symbols naming special forms are tagged with their keyword when
+// they're interned, so the evaluator can dispatch on a switch instead
+// of comparing names.
+enum class Keyword : std::uint8_t {
+    None, And, Begin, Define, If, Lambda, Or, Quasiquote, Quote, Set,
+    Unquote, UnquoteSplicing
+};
+
+// Symbols are interned: intern() returns the one SchemeSymbol for a
+// given name, creating it on first use, so two symbols are the same
+// exactly when they are the same object. Each symbol also gets a
+// small integer id that environments use as their key. Symbols are
+// never freed; the table keeps a reference to every one of them.
+struct SchemeSymbol : HeapObject {
+    const std::string string;
+    const std::size_t id;
+    const Keyword keyword;
+
+    bool operator==(const SchemeSymbol& rhs) const { return this == &rhs; }
+    bool operator!=(const SchemeSymbol& rhs) const { return this != &rhs; }
+
+private:
+    SchemeSymbol(const std::string& string, std::size_t id, Keyword keyword)
+        : HeapObject(HeapType::Symbol), string(string), id(id),
+          keyword(keyword) {}
+
+    friend const SchemeSymbol *intern(const std::string& name);
+};
+
+const SchemeSymbol *intern(const std::string& name);
+
+struct SymbolTableStats {
+    std::size_t symbols;        // number of interned symbols
+    std::size_t bytes;          // memory held by symbols and the table
+};
+
+SymbolTableStats symbolTableStats();
+
+// A Scheme value is a single tagged 64-bit word. The low three bits
+// select the representation: fixnums, characters, booleans and the
+// empty list are stored inline in the upper 32 bits, and a zero tag
+// means the word is a pointer to a HeapObject (which is always at
+// least 8-byte aligned).
+//
+// The word comes in two kinds of reference. A SchemeExpr, held
+// anywhere outside the heap, roots the object it points to. A HeapExpr
+// is a field of a heap object; it doesn't root anything, and the
+// collector finds it by tracing the object that holds it. ExprWord is
+// the part they share.
+class ExprWord {
+public:
+    enum Tag : std::uint64_t {
+        Pointer   = 0,
+        Fixnum    = 1,
+        Character = 2,
+        Boolean   = 3,
+        Empty     = 4
+    };
+
+    static const std::uint64_t tagMask = 7;
+
+    Tag tag() const { return static_cast<Tag>(bits & tagMask); }
+    std::uint64_t raw() const { return bits; }
+
+    bool isPointer()   const { return tag() == Pointer; }
+    bool isFixnum()    const { return tag() == Fixnum; }
+    bool isCharacter() const { return tag() == Character; }
+    bool isBoolean()   const { return tag() == Boolean; }
+    bool isNil()       const { return bits == Empty; }
+    bool isUnbound()   const { return bits == immediate(Empty, 1); }
+
+    bool isHeapType(HeapType type) const {
+        return isPointer() && object()->heapType == type;
+    }
+
+    bool isString()   const { return isHeapType(HeapType::String); }
+    bool isSymbol()   const { return isHeapType(HeapType::Symbol); }
+    bool isCons()     const { return isHeapType(HeapType::Cons); }
+    bool isFunction() const {
+        return isPointer() && object()->heapType >= HeapType::Function;
+    }
+
+    int  fixnum()    const { return static_cast<std::int32_t>(bits >> 32); }
+    char character() const { return static_cast<char>(bits >> 32); }
+    bool boolean()   const { return (bits >> 32) != 0; }
+
+    HeapObject *object() const {
+        return reinterpret_cast<HeapObject *>(bits);
+    }
+
+protected:
+    std::uint64_t bits;
+
+    explicit ExprWord(std::uint64_t bits) : bits(bits) {}
+
+    static std::uint64_t immediate(Tag tag, std::uint32_t payload) {
+        return static_cast<std::uint64_t>(payload) << 32 | tag;
+    }
+};
+
+class HeapExpr : public ExprWord {
+public:
+    HeapExpr() : ExprWord(Empty) {}
+    HeapExpr(const ExprWord& e) : ExprWord(e) {}
+    explicit HeapExpr(HeapObject *object)
+        : ExprWord(reinterpret_cast<std::uint64_t>(object)) {}
 
-    SchemeSymbol(const std::string& string): string(string) {}
+    HeapExpr& operator=(const ExprWord& e) {
+        bits = e.raw();
+        return *this;
+    }
+};
+
+class SchemeExpr : public ExprWord {
+public:
+    SchemeExpr() : ExprWord(Empty) {}
 
-    bool operator==(const SchemeSymbol& rhs) const {
-        return rhs.string == string;
+    // The Empty tag with a non-zero payload marks an environment slot
+    // that has been allocated but not yet defined. It is never the
+    // value of an expression.
+    static SchemeExpr unbound() {
+        SchemeExpr e;
+        e.bits = immediate(Empty, 1);
+        return e;
     }
 
-    bool operator!=(const SchemeSymbol& rhs) const {
-        return !(*this == rhs);
+    SchemeExpr(int i)
+        : ExprWord(immediate(Fixnum, static_cast<std::uint32_t>(i))) {}
+    SchemeExpr(char c)
+        : ExprWord(immediate(Character, static_cast<unsigned char>(c))) {}
+    SchemeExpr(bool b) : ExprWord(immediate(Boolean, b)) {}
+    SchemeExpr(Nil) : ExprWord(Empty) {}
+    SchemeExpr(const char *string);
+    SchemeExpr(const std::string& string);
+    SchemeExpr(const SchemeSymbol *symbol);
+    SchemeExpr(SchemeCons *cons);
+    SchemeExpr(SchemeFunction *function);
+
+    SchemeExpr(const HeapExpr& e) : ExprWord(e) { retain(); }
+    SchemeExpr(const SchemeExpr& other) : ExprWord(other) { retain(); }
+    SchemeExpr(SchemeExpr&& other) noexcept : ExprWord(other) {
+        other.bits = Empty;
+    }
+
+    ~SchemeExpr() { release(); }
+
+    SchemeExpr& operator=(const SchemeExpr& other) {
+        SchemeExpr(other).swap(*this);
+        return *this;
+    }
+
+    SchemeExpr& operator=(SchemeExpr&& other) noexcept {
+        SchemeExpr(std::move(other)).swap(*this);
+        return *this;
+    }
+
+    void swap(SchemeExpr& other) noexcept { std::swap(bits, other.bits); }
+
+private:
+    explicit SchemeExpr(HeapObject *object)
+        : ExprWord(reinterpret_cast<std::uint64_t>(object)) { retain(); }
+
+    void retain() const {
+        if (isPointer()) ++object()->rootCount;
+    }
+
+    void release() const {
+        if (isPointer()) --object()->rootCount;
     }
 };
 
-typedef boost::make_recursive_variant<
-    int, char, bool, std::string, SchemeSymbol, Nil,
-    std::shared_ptr<SchemeFunction>,
-    std::pair<boost::recursive_variant_, boost::recursive_variant_>
-    >::type SchemeExpr;
-std::ostream& operator<<(std::ostream& os, const SchemeExpr& e);
+// A pointer to a heap object of a particular type that roots it, as
+// SchemeExpr does for values.
+template <typename T>
+class Handle {
+    T *pointer;
+public:
+    Handle() : pointer(nullptr) {}
+    Handle(T *pointer) : pointer(pointer) { retain(); }
+    Handle(const Handle& other) : pointer(other.pointer) { retain(); }
+    Handle(Handle&& other) noexcept : pointer(other.pointer) {
+        other.pointer = nullptr;
+    }
+
+    ~Handle() { if (pointer) --pointer->rootCount; }
+
+    Handle& operator=(Handle other) noexcept {
+        std::swap(pointer, other.pointer);
+        return *this;
+    }
 
-typedef std::pair<SchemeExpr, SchemeExpr> SchemeCons;
+    T *get() const { return pointer; }
+    T *operator->() const { return pointer; }
+    T& operator*() const { return *pointer; }
+    explicit operator bool() const { return pointer != nullptr; }
+
+private:
+    void retain() const {
+        if (pointer) ++pointer->rootCount;
+    }
+};
+
+template <typename T, typename... Args>
+Handle<T> makeHandle(Args&&... args)
+{
+    return Handle<T>(new T(std::forward<Args>(args)...));
+}
+
+// The write barrier, run before value is stored over old in one of
+// object's fields. A minor collection only traces the nursery and the
+// objects outside it that were remembered here when a reference to a
+// Young pair was stored in them. While a major collection is marking
+// incrementally, the value being overwritten is shaded, so everything
+// reachable when marking began is marked even if the mutator moves it
+// behind the marker's back.
+extern bool markingInProgress;
+
+void remember(HeapObject *object);
+void shade(HeapObject *object);
+
+inline void writeBarrier(HeapObject *object, const ExprWord& old,
+                         const ExprWord& value)
+{
+    if (markingInProgress && old.isPointer()) shade(old.object());
+    if (value.isPointer() && value.object()->space == Space::Young
+        && object->space != Space::Young && !object->remembered) {
+        remember(object);
+    }
+}
+
+// Memory for objects other than pairs, from the collector's pool for
+// their size if they are small. freeSmall must be passed the same size.
+void *allocateSmall(std::size_t size);
+void freeSmall(void *memory, std::size_t size);
+
+// Allocates the slots of frames from the same pools.
+template <typename T>
+struct PoolAllocator {
+    typedef T value_type;
+
+    PoolAllocator() = default;
+    template <typename U> PoolAllocator(const PoolAllocator<U>&) {}
+
+    T *allocate(std::size_t n) {
+        return static_cast<T *>(allocateSmall(n * sizeof(T)));
+    }
+
+    void deallocate(T *memory, std::size_t n) {
+        freeSmall(memory, n * sizeof(T));
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&)
+{
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&)
+{
+    return false;
+}
+
+// The part of the nursery pairs are being bump-allocated from. When it
+// runs out, refillNursery() starts another block.
+struct AllocationBuffer {
+    char *top;
+    char *limit;
+};
+
+extern AllocationBuffer nursery;
+void *refillNursery(std::size_t size);
+
+bool operator==(const ExprWord& lhs, const ExprWord& rhs);
+bool operator!=(const ExprWord& lhs, const ExprWord& rhs);
+std::ostream& operator<<(std::ostream& os, const ExprWord& e);
+
+// The arguments of a call: a view of values the caller holds, in a
+// vector, a buffer on the C++ stack or wherever, and keeps rooted until
+// the call returns. Functions only read them, so passing them on never
+// copies them.
+class SchemeArgs {
+    const SchemeExpr *first;
+    std::size_t count;
+public:
+    typedef const SchemeExpr *const_iterator;
+    typedef const_iterator iterator;
+
+    SchemeArgs(const SchemeExpr *first, std::size_t count)
+        : first(first), count(count) {}
+    SchemeArgs(const std::vector<SchemeExpr>& args)
+        : first(args.data()), count(args.size()) {}
+    // A view of a temporary vector would outlive its elements.
+    SchemeArgs(std::vector<SchemeExpr>&&) = delete;
+
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const SchemeExpr *data() const { return first; }
+    const_iterator begin() const { return first; }
+    const_iterator end() const { return first + count; }
+    const SchemeExpr& front() const { return first[0]; }
+    const SchemeExpr& back() const { return first[count - 1]; }
+    const SchemeExpr& operator[](std::size_t i) const { return first[i]; }
+};
+
+// Holds the arguments of a call while they are evaluated and passed.
+// Up to four are kept in the buffer itself, which lives on the C++
+// stack, so most calls don't allocate; more go in a vector, whose
+// storage is kept for the buffer's next call.
+class ArgBuffer {
+    static const std::size_t inlineCount = 4;
+    SchemeExpr inlineArgs[inlineCount];
+    std::vector<SchemeExpr> moreArgs;
+    SchemeExpr *first = inlineArgs;
+    std::size_t count = 0;
+public:
+    ArgBuffer() = default;
+    ArgBuffer(const ArgBuffer&) = delete;
+    ArgBuffer& operator=(const ArgBuffer&) = delete;
+
+    // Drops the arguments held, and makes room for n more.
+    void reset(std::size_t n) {
+        for (std::size_t i = 0; i < count; ++i) first[i] = SchemeExpr();
+        moreArgs.clear();
+        if (n <= inlineCount) {
+            first = inlineArgs;
+        } else {
+            moreArgs.resize(n);
+            first = moreArgs.data();
+        }
+        count = n;
+    }
+
+    SchemeExpr& operator[](std::size_t i) { return first[i]; }
+
+    const SchemeExpr *data() const { return first; }
+    std::size_t size() const { return count; }
+
+    operator SchemeArgs() const { return SchemeArgs(first, count); }
+};
+
+struct StringObject : HeapObject {
+    const std::string value;
+
+    StringObject(const std::string& value)
+        : HeapObject(HeapType::String), value(value) {}
+};
+
+// Pairs are shared and mutable: every SchemeExpr referring to a pair
+// points at the same SchemeCons, so car, cdr and cons never copy.
+struct SchemeCons : HeapObject {
+    HeapExpr car;
+    HeapExpr cdr;
+
+    SchemeCons(const ExprWord& car, const ExprWord& cdr,
+               Space space = Space::Young)
+        : HeapObject(HeapType::Cons, space), car(car), cdr(cdr) {}
+
+    static void *operator new(std::size_t size) {
+        if (static_cast<std::size_t>(nursery.limit - nursery.top) < size) {
+            return refillNursery(size);
+        }
+        void *memory = nursery.top;
+        nursery.top += size;
+        return memory;
+    }
+
+    // Nursery memory is reclaimed a block at a time by the collector.
+    static void operator delete(void *, std::size_t) {}
+};
+
+struct SchemeFunction : HeapObject {
+    SchemeFunction(HeapType type = HeapType::Function) : HeapObject(type) {}
+    virtual ~SchemeFunction() = default;
+    virtual SchemeExpr operator()(const SchemeArgs& args) = 0;
+
+    // Functions that refer to other heap objects mark them here.
+    virtual void trace(Tracer&) const {}
+};
+
+inline const std::string& asString(const ExprWord& e)
+{
+    return static_cast<const StringObject *>(e.object())->value;
+}
+
+inline const SchemeSymbol& asSymbol(const ExprWord& e)
+{
+    return *static_cast<const SchemeSymbol *>(e.object());
+}
+
+inline SchemeCons *asCons(const ExprWord& e)
+{
+    return static_cast<SchemeCons *>(e.object());
+}
+
+inline SchemeFunction *asFunction(const ExprWord& e)
+{
+    return static_cast<SchemeFunction *>(e.object());
+}
+
+inline Keyword keywordOf(const ExprWord& e)
+{
+    return e.isSymbol() ? asSymbol(e).keyword : Keyword::None;
+}
 
 class scheme_error : public std::exception {
     const std::string what_;
@@ -45,70 +492,136 @@ public:
         { return what_.c_str(); }
 };
 
-SchemeCons consFromVector(const std::vector<SchemeExpr>& vector);
-std::vector<SchemeExpr> vectorFromCons(SchemeCons cons);
+// Calls the overload of visitor matching the dynamic type of e,
+// passing it the unboxed value. Visitors declare their result_type.
+template <typename Visitor>
+typename Visitor::result_type
+applyVisitor(const Visitor& visitor, const ExprWord& e)
+{
+    switch (e.tag()) {
+    case ExprWord::Fixnum:    return visitor(e.fixnum());
+    case ExprWord::Character: return visitor(e.character());
+    case ExprWord::Boolean:   return visitor(e.boolean());
+    case ExprWord::Empty:     return visitor(Nil::Nil);
+    case ExprWord::Pointer:   break;
+    }
+
+    switch (e.object()->heapType) {
+    case HeapType::String:   return visitor(asString(e));
+    case HeapType::Symbol:   return visitor(asSymbol(e));
+    case HeapType::Cons:     return visitor(asCons(e));
+    case HeapType::Environment:
+        throw scheme_error("Environments are not values");
+    case HeapType::Function:
+    case HeapType::Lexical:
+    case HeapType::Closure:  break;
+    }
+    return visitor(asFunction(e));
+}
+
+SchemeExpr consFromVector(const SchemeArgs& elements);
+std::vector<SchemeExpr> vectorFromCons(const SchemeCons *cons);
+std::size_t listLength(const ExprWord& list);
 SchemeExpr append(const SchemeExpr& x, SchemeExpr y);
 
-class SchemeEnvironment
-    : public std::enable_shared_from_this<SchemeEnvironment> {
-    std::map<std::string, SchemeExpr> definitions;
-    std::shared_ptr<SchemeEnvironment> outer;
+// There are two kinds of environment. The global environment keys its
+// slots on symbol id and grows as definitions are made. A frame is
+// created for each function call, and holds the function's parameters
+// followed by any variables its body defines; the analyzer has already
+// turned every reference to them into a (depth, slot) address. Frames
+// chain through outer to the environment the function was created in,
+// ending at the global environment.
+class SchemeEnvironment : public HeapObject {
+    std::vector<HeapExpr, PoolAllocator<HeapExpr>> slots;
+    SchemeEnvironment *outer;
 public:
-    SchemeEnvironment() = default;
-
-    SchemeEnvironment(const std::vector<SchemeSymbol>& params,
-                      const std::vector<SchemeExpr>& args)
-        : SchemeEnvironment(params, args, false)
-    {}
-
-    SchemeEnvironment(const std::vector<SchemeSymbol>& params,
-                      const std::vector<SchemeExpr>& args,
-                      bool hasRestParam)
-        : SchemeEnvironment(params, args, hasRestParam, nullptr)
-    {}
-
-    SchemeEnvironment(const std::vector<SchemeSymbol>& params,
-                      const std::vector<SchemeExpr>& args,
-                      bool hasRestParam,
-                      std::shared_ptr<SchemeEnvironment> outer);
-      
-    std::shared_ptr<SchemeEnvironment> find(const std::string& var) {
-        if (definitions.find(var) != definitions.end()) {
-            return shared_from_this();
-        } else if (outer != nullptr) {
-            return outer->find(var);
+    SchemeEnvironment()
+        : HeapObject(HeapType::Environment), outer(nullptr) {}
+
+    // A global environment that starts out with base's definitions.
+    explicit SchemeEnvironment(const SchemeEnvironment& base)
+        : HeapObject(HeapType::Environment), slots(base.slots),
+          outer(nullptr) {}
+
+    SchemeEnvironment(std::size_t frameSize, std::size_t paramCount,
+                      const SchemeExpr *args, std::size_t argCount,
+                      bool hasRestParam, SchemeEnvironment *outer);
+
+    SchemeEnvironment *up(std::size_t depth) {
+        SchemeEnvironment *env = this;
+        while (depth--) env = env->outer;
+        return env;
+    }
+
+    const HeapExpr& slot(std::size_t i) const {
+        return slots[i];
+    }
+
+    void setSlot(std::size_t i, const ExprWord& value) {
+        writeBarrier(this, slots[i], value);
+        slots[i] = value;
+    }
+
+    const HeapExpr *lookup(const SchemeSymbol& symbol) const {
+        if (symbol.id < slots.size() && !slots[symbol.id].isUnbound()) {
+            return &slots[symbol.id];
         } else {
             return nullptr;
         }
     }
 
-    SchemeExpr& operator[](const std::string& symbol) {
-        return definitions[symbol];
+    void define(const SchemeSymbol& symbol, const SchemeExpr& value) {
+        if (symbol.id >= slots.size()) {
+            slots.resize(symbol.id + 1, SchemeExpr::unbound());
+        }
+        writeBarrier(this, slots[symbol.id], value);
+        slots[symbol.id] = value;
     }
+
+    void trace(Tracer& tracer);
 };
 
-inline SchemeCons consValue(const SchemeExpr& e)
+typedef Handle<SchemeEnvironment> EnvPointer;
+
+inline SchemeCons *consValue(const ExprWord& e)
 {
-    try {
-        return boost::get<SchemeCons>(e);
-    } catch (const boost::bad_get&) {
+    if (e.isCons()) {
+        return asCons(e);
+    } else {
         std::ostringstream error;
         error << "Cons expected, got " << e;
         throw scheme_error(error);
     }
 }
 
-inline SchemeExpr car(const SchemeCons& c)
+inline SchemeExpr cons(const SchemeExpr& car, const SchemeExpr& cdr)
+{
+    return new SchemeCons(car, cdr);
+}
+
+inline const HeapExpr& car(const SchemeCons *c)
+{
+    return c->car;
+}
+
+inline const HeapExpr& cdr(const SchemeCons *c)
+{
+    return c->cdr;
+}
+
+inline void setCar(SchemeCons *c, const SchemeExpr& car)
 {
-    return c.first;
+    writeBarrier(c, c->car, car);
+    c->car = car;
 }
 
-inline SchemeExpr cdr(const SchemeCons& c)
+inline void setCdr(SchemeCons *c, const SchemeExpr& cdr)
 {
-    return c.second;
+    writeBarrier(c, c->cdr, cdr);
+    c->cdr = cdr;
 }
 
-inline std::vector<SchemeExpr> vectorFromExpr(const SchemeExpr& expr)
+inline std::vector<SchemeExpr> vectorFromExpr(const ExprWord& expr)
 {
     if (SchemeExpr(Nil::Nil) == expr) {
         return {};
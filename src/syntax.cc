@@ -0,0 +1,85 @@
+#include <algorithm>
+#include <sstream>
+#include "parser.hh"
+#include "syntax.hh"
+
+std::size_t Scope::declare(const SchemeSymbol *name)
+{
+    auto found = std::find(names.begin(), names.end(), name);
+    if (found != names.end()) {
+        return static_cast<std::size_t>(found - names.begin());
+    }
+    names.push_back(name);
+    return names.size() - 1;
+}
+
+Address resolve(const SchemeSymbol& symbol, const Scope *scope)
+{
+    std::size_t depth = 0;
+    for (; scope; scope = scope->outer, ++depth) {
+        const auto& names = scope->names;
+        auto found = std::find(names.begin(), names.end(), &symbol);
+        if (found != names.end()) {
+            return { false, depth,
+                     static_cast<std::size_t>(found - names.begin()) };
+        }
+    }
+    return { true, depth, 0 };
+}
+
+LambdaList parseLambdaList(const SchemeArgs& args)
+{
+    if (args.empty()) throw scheme_error("lambda requires a parameter list");
+
+    auto procArgs = vectorFromExpr(args[0]);
+    LambdaList list{ {}, false };
+    const SchemeSymbol *rest = intern("&rest");
+
+    for (std::size_t i = 0; i < procArgs.size(); ++i) {
+        if (&symbolValue(procArgs[i]) != rest) {
+            list.params.push_back(&symbolValue(procArgs[i]));
+        } else if (i == procArgs.size() - 2) { // only one rest parameter
+            list.hasRestParam = true;
+            list.params.push_back(&symbolValue(procArgs[i + 1]));
+            break;
+        } else {
+            throw scheme_error("Illegal rest parameter in lambda list");
+        }
+    }
+
+    return list;
+}
+
+void declareDefinitions(const SchemeExpr& form, Scope& scope)
+{
+    if (!form.isCons()) return;
+    auto cons = asCons(form);
+    Keyword keyword = keywordOf(car(cons));
+    if (keyword == Keyword::Define) {
+        const auto& rest = cdr(cons);
+        if (rest.isCons() && car(asCons(rest)).isSymbol()) {
+            scope.declare(&asSymbol(car(asCons(rest))));
+        }
+    } else if (keyword == Keyword::Begin) {
+        for (const auto& subform : vectorFromExpr(cdr(cons))) {
+            declareDefinitions(subform, scope);
+        }
+    }
+}
+
+void requireArgs(const char *form, const SchemeArgs& args, std::size_t n)
+{
+    if (args.size() != n) {
+        const char *counts[] = { "no", "one", "two", "three" };
+        std::ostringstream error;
+        error << form << " requires " << counts[n] << " argument";
+        if (n != 1) error << "s";
+        error << ", passed " << args.size();
+        throw scheme_error(error);
+    }
+}
+
+bool isSplice(const SchemeExpr& e)
+{
+    return e.isCons() && keywordOf(car(asCons(e))) == Keyword::UnquoteSplicing;
+}
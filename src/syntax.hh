@@ -0,0 +1,53 @@
+#ifndef SYNTAX_HH
+#define SYNTAX_HH
+
+#include <cstddef>
+#include <vector>
+#include "scheme_types.hh"
+
+// Syntax checks and variable resolution shared by analyze() in eval.cc
+// and compile() in compiler.cc, so both ways of running a program
+// accept the same forms and lay out frames the same way.
+
+// The analysis-time picture of the frames a lambda's body will run in:
+// the name in each slot of the frame, and the scope of the lambda that
+// encloses this one. A null Scope is the global environment. Only a
+// closure made in the body can keep a frame alive after its call
+// returns, so the frames of a body without lambdas never escape.
+struct Scope {
+    std::vector<const SchemeSymbol *> names;
+    const Scope *outer;
+    bool hasLambdas = false;
+
+    Scope(std::vector<const SchemeSymbol *> names, const Scope *outer)
+        : names(names), outer(outer) {}
+
+    std::size_t declare(const SchemeSymbol *name);
+};
+
+struct Address {
+    bool global;
+    std::size_t depth, slot;
+};
+
+Address resolve(const SchemeSymbol& symbol, const Scope *scope);
+
+struct LambdaList {
+    std::vector<const SchemeSymbol *> params;
+    bool hasRestParam;
+};
+
+// Reads the parameter list of (lambda params body...), whose arguments
+// are args. A parameter preceded by &rest takes any remaining arguments.
+LambdaList parseLambdaList(const SchemeArgs& args);
+
+// Give every variable a body defines a slot before analyzing the body,
+// so references that textually precede a define (as in mutually
+// recursive internal definitions) resolve to the frame.
+void declareDefinitions(const SchemeExpr& form, Scope& scope);
+
+void requireArgs(const char *form, const SchemeArgs& args, std::size_t n);
+
+bool isSplice(const SchemeExpr& e);
+
+#endif
@@ -0,0 +1,347 @@
+#include <sstream>
+#include <vector>
+#include "eval.hh"
+#include "gc.hh"
+#include "parser.hh"
+#include "scheme_types.hh"
+#include "vm.hh"
+
+// GCC and Clang can dispatch through a table of label addresses, which
+// skips the switch's range check and gives every instruction its own
+// indirect branch for the predictor to learn. Build with
+// -DVM_COMPUTED_GOTO=0 to use a plain switch instead.
+#ifndef VM_COMPUTED_GOTO
+#if defined(__GNUC__)
+#define VM_COMPUTED_GOTO 1
+#else
+#define VM_COMPUTED_GOTO 0
+#endif
+#endif
+
+namespace {
+
+SchemeExpr run(const Code& entry, EnvPointer env);
+
+class Closure : public SchemeFunction {
+public:
+    CodePointer code;
+    SchemeEnvironment *env;
+
+    Closure(CodePointer code, SchemeEnvironment *env)
+        : SchemeFunction(HeapType::Closure), code(code), env(env) {}
+
+    EnvPointer frame(const SchemeExpr *args, std::size_t argCount) const {
+        return makeHandle<SchemeEnvironment>(
+            code->frameSize, code->paramCount, args, argCount,
+            code->hasRestParam, env);
+    }
+
+    virtual SchemeExpr operator()(const SchemeArgs& args) override {
+        safePoint();
+        return run(*code, frame(args.data(), args.size()));
+    }
+
+    virtual void trace(Tracer& tracer) const override {
+        tracer.mark(env);
+    }
+};
+
+// Where to continue when the running function returns. The callee is
+// held here so its code stays alive while it runs, even if the program
+// drops every other reference to it.
+struct ReturnPoint {
+    const Code *code;
+    const std::uint16_t *pc;
+    EnvPointer env;
+    SchemeExpr callee;
+};
+
+// The operand and return stacks are shared by every run(), so a
+// closure called back from outside the VM pushes onto the same stacks.
+struct Machine {
+    std::vector<SchemeExpr> stack;
+    std::vector<ReturnPoint> returns;
+    std::size_t maxDepth = defaultMaxCallDepth;
+};
+
+Machine& machine()
+{
+    static Machine machine;
+    return machine;
+}
+
+// Puts the stacks back as run() found them, however it exits.
+class StackGuard {
+    Machine& machine;
+    std::size_t stackBase, returnBase;
+public:
+    StackGuard(Machine& machine)
+        : machine(machine), stackBase(machine.stack.size()),
+          returnBase(machine.returns.size()) {}
+
+    ~StackGuard() {
+        machine.stack.resize(stackBase);
+        machine.returns.erase(machine.returns.begin() + returnBase,
+                              machine.returns.end());
+    }
+
+    std::size_t returnDepth() const { return returnBase; }
+};
+
+[[noreturn]] void undefinedSymbol(const SchemeExpr& name)
+{
+    std::ostringstream error;
+    error << "Undefined symbol: " << asSymbol(name).string;
+    throw scheme_error(error);
+}
+
+[[noreturn]] void callDepthExceeded(std::size_t depth)
+{
+    std::ostringstream error;
+    error << "Maximum call depth of " << depth << " exceeded";
+    throw scheme_error(error);
+}
+
+bool isFalse(const SchemeExpr& e)
+{
+    return e.isBoolean() && !e.boolean();
+}
+
+SchemeExpr run(const Code& entry, EnvPointer env)
+{
+    auto& stack = machine().stack;
+    auto& returns = machine().returns;
+    StackGuard guard(machine());
+
+    const Code *code = &entry;
+    const std::uint16_t *pc = code->instructions.data();
+    ArgBuffer argv;             // reused for every call to a primitive
+
+#if VM_COMPUTED_GOTO
+    static void *const targets[] = {
+#define SCHEME_OPCODE_TARGET(name, operands) &&op##name,
+        SCHEME_OPCODES(SCHEME_OPCODE_TARGET)
+#undef SCHEME_OPCODE_TARGET
+    };
+#define TARGET(name) op##name:
+#define DISPATCH() goto *targets[*pc++]
+    DISPATCH();
+#else
+#define TARGET(name) case Opcode::name:
+#define DISPATCH() continue
+    for (;;) switch (static_cast<Opcode>(*pc++)) {
+#endif
+
+    TARGET(Constant) {
+        stack.push_back(code->constants[pc[0]]);
+        pc += 1;
+        DISPATCH();
+    }
+
+    TARGET(LocalRef) {
+        const HeapExpr& value = env->up(pc[0])->slot(pc[1]);
+        if (value.isUnbound()) undefinedSymbol(code->constants[pc[2]]);
+        stack.push_back(value);
+        pc += 3;
+        DISPATCH();
+    }
+
+    TARGET(LocalSet) {
+        SchemeEnvironment *frame = env->up(pc[0]);
+        if (frame->slot(pc[1]).isUnbound()) {
+            undefinedSymbol(code->constants[pc[2]]);
+        }
+        frame->setSlot(pc[1], stack.back());
+        stack.back() = code->constants[pc[2]];
+        pc += 3;
+        DISPATCH();
+    }
+
+    TARGET(LocalDefine) {
+        env->setSlot(pc[0], stack.back());
+        stack.back() = code->constants[pc[1]];
+        pc += 2;
+        DISPATCH();
+    }
+
+    TARGET(GlobalRef) {
+        const SchemeExpr& name = code->constants[pc[1]];
+        const HeapExpr *value = env->up(pc[0])->lookup(asSymbol(name));
+        if (!value) undefinedSymbol(name);
+        stack.push_back(*value);
+        pc += 2;
+        DISPATCH();
+    }
+
+    TARGET(GlobalSet) {
+        const SchemeExpr& name = code->constants[pc[1]];
+        SchemeEnvironment *global = env->up(pc[0]);
+        if (!global->lookup(asSymbol(name))) undefinedSymbol(name);
+        global->define(asSymbol(name), stack.back());
+        stack.back() = name;
+        pc += 2;
+        DISPATCH();
+    }
+
+    TARGET(GlobalDefine) {
+        const SchemeExpr& name = code->constants[pc[0]];
+        env->define(asSymbol(name), stack.back());
+        stack.back() = name;
+        pc += 1;
+        DISPATCH();
+    }
+
+    TARGET(Pop) {
+        stack.pop_back();
+        DISPATCH();
+    }
+
+    TARGET(Jump) {
+        pc = code->instructions.data() + pc[0];
+        DISPATCH();
+    }
+
+    TARGET(JumpIfFalse) {
+        bool test = boolValue(stack.back());
+        stack.pop_back();
+        pc = test ? pc + 1 : code->instructions.data() + pc[0];
+        DISPATCH();
+    }
+
+    TARGET(JumpIfFalseOrPop) {
+        if (isFalse(stack.back())) {
+            pc = code->instructions.data() + pc[0];
+        } else {
+            stack.pop_back();
+            pc += 1;
+        }
+        DISPATCH();
+    }
+
+    TARGET(JumpIfTrueOrPop) {
+        if (!isFalse(stack.back())) {
+            pc = code->instructions.data() + pc[0];
+        } else {
+            stack.pop_back();
+            pc += 1;
+        }
+        DISPATCH();
+    }
+
+    TARGET(MakeClosure) {
+        stack.push_back(new Closure(code->functions[pc[0]], env.get()));
+        pc += 1;
+        DISPATCH();
+    }
+
+    // A tail call to a closure from inside a function the VM called
+    // takes over that function's return point, so the callee returns
+    // straight to our caller and loops run without growing the return
+    // stack. Anything else is made as an ordinary call.
+    TARGET(TailCall) {
+        std::size_t argCount = pc[0];
+        SchemeExpr *args = stack.data() + stack.size() - argCount;
+        SchemeExpr& callee = args[-1];
+
+        if (callee.isHeapType(HeapType::Closure)
+            && returns.size() > guard.returnDepth()) {
+            safePoint();
+            auto closure = static_cast<Closure *>(asFunction(callee));
+            if (code->functions.empty()) releaseFrame(env);
+            env = closure->frame(args, argCount);
+            returns.back().callee = std::move(callee);
+            stack.resize(stack.size() - argCount - 1);
+            code = closure->code.get();
+            pc = code->instructions.data();
+            DISPATCH();
+        }
+        goto call;
+    }
+
+    TARGET(Call) {
+    call:
+        std::size_t argCount = pc[0];
+        pc += 1;
+        SchemeExpr *args = stack.data() + stack.size() - argCount;
+        SchemeExpr& callee = args[-1];
+
+        if (callee.isHeapType(HeapType::Closure)) {
+            auto closure = static_cast<Closure *>(asFunction(callee));
+            if (returns.size() >= machine().maxDepth) {
+                callDepthExceeded(machine().maxDepth);
+            }
+            safePoint();
+            auto frame = closure->frame(args, argCount);
+            returns.push_back({ code, pc, std::move(env), std::move(callee) });
+            stack.resize(stack.size() - argCount - 1);
+            code = closure->code.get();
+            pc = code->instructions.data();
+            env = std::move(frame);
+        } else {
+            SchemeExpr function = std::move(callee);
+            argv.reset(argCount);
+            for (std::size_t i = 0; i < argCount; ++i) {
+                argv[i] = std::move(args[i]);
+            }
+            stack.resize(stack.size() - argCount - 1);
+            stack.push_back(callFunction(functionPointer(function),
+                                         argv.data(), argv.size()));
+            argv.reset(0);
+        }
+        DISPATCH();
+    }
+
+    TARGET(Cons) {
+        SchemeExpr cdr = std::move(stack.back());
+        stack.pop_back();
+        stack.back() = ::cons(std::move(stack.back()), std::move(cdr));
+        DISPATCH();
+    }
+
+    TARGET(Append) {
+        SchemeExpr tail = std::move(stack.back());
+        stack.pop_back();
+        stack.back() = append(stack.back(), std::move(tail));
+        DISPATCH();
+    }
+
+    TARGET(Return) {
+        SchemeExpr value = std::move(stack.back());
+        stack.pop_back();
+        if (returns.size() == guard.returnDepth()) return value;
+
+        // A function that makes no closures leaves nothing referring
+        // to its frame
+        if (code->functions.empty()) releaseFrame(env);
+        auto& point = returns.back();
+        code = point.code;
+        pc = point.pc;
+        env = std::move(point.env);
+        returns.pop_back();
+        stack.push_back(std::move(value));
+        DISPATCH();
+    }
+
+#if !VM_COMPUTED_GOTO
+    }
+#endif
+#undef TARGET
+#undef DISPATCH
+}
+
+} // end namespace
+
+SchemeExpr execute(const CodePointer& code, EnvPointer env)
+{
+    return run(*code, std::move(env));
+}
+
+void setMaxCallDepth(std::size_t depth)
+{
+    machine().maxDepth = depth;
+}
+
+std::size_t maxCallDepth()
+{
+    return machine().maxDepth;
+}
@@ -0,0 +1,23 @@
+#ifndef VM_HH
+#define VM_HH
+
+#include <cstddef>
+#include "compiler.hh"
+#include "scheme_types.hh"
+
+// Runs compiled code in env and returns its value. Calls between
+// closures the compiler created stay inside the VM's dispatch loop,
+// which keeps its own operand stack and return stack; other functions
+// are called through SchemeFunction::operator().
+SchemeExpr execute(const CodePointer& code, EnvPointer env);
+
+// Since the return stack is on the heap, recursion that isn't in tail
+// position is limited only by memory and by this maximum number of
+// nested calls, past which a call throws scheme_error. It defaults to
+// defaultMaxCallDepth.
+const std::size_t defaultMaxCallDepth = 10000000;
+
+void setMaxCallDepth(std::size_t depth);
+std::size_t maxCallDepth();
+
+#endif
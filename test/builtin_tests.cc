@@ -1,5 +1,6 @@
 #include "gtest/gtest.h"
 #include "builtins.hh"
+#include "eval.hh"
 #include "parser.hh"
 #include "scheme_types.hh"
 
@@ -345,6 +346,11 @@ TEST(ListToString, ThrowsOnNonListArg) {
     ASSERT_THROW(eval(parse("(list->string 'foo)")), scheme_error);
 }
 
+TEST(ListToString, ThrowsOnImproperList) {
+    ASSERT_THROW(eval(parse("(list->string (cons #\\a #\\b))")),
+                 scheme_error);
+}
+
 TEST(ListToString, ThrowsIfListContainsNonCharacters) {
     ASSERT_THROW(eval(parse("(list->string '(#\\a 'b #\\c))")), scheme_error);
 }
@@ -400,6 +406,64 @@ TEST(Null, ReturnsFalseExceptOnTheEmptyList) {
     ASSERT_FALSE(boolValue(eval(parse("(null? #t)"))));
 }
 
+// set-car!
+
+TEST(SetCar, ThrowsWithWrongNumberOfArgs) {
+    ASSERT_THROW(eval(parse("(set-car! (cons 1 2))")), scheme_error);
+    ASSERT_THROW(eval(parse("(set-car! (cons 1 2) 3 4)")), scheme_error);
+}
+
+TEST(SetCar, ThrowsWithNonConsArg) {
+    ASSERT_THROW(eval(parse("(set-car! 1 2)")), scheme_error);
+}
+
+TEST(SetCar, ReplacesTheCarOfACons) {
+    auto program = "((lambda (x) (set-car! x 3) (car x)) (cons 1 2))";
+    ASSERT_EQ(3, intValue(eval(parse(program))));
+}
+
+TEST(SetCar, ReturnsFalse) {
+    ASSERT_FALSE(boolValue(eval(parse("(set-car! (cons 1 2) 3)"))));
+}
+
+TEST(SetCar, IsVisibleThroughEveryReferenceToTheCons) {
+    auto program = "((lambda (x) ((lambda (y) (set-car! y 3) (car x)) x))\
+                     (cons 1 2))";
+    ASSERT_EQ(3, intValue(eval(parse(program))));
+}
+
+// set-cdr!
+
+TEST(SetCdr, ThrowsWithWrongNumberOfArgs) {
+    ASSERT_THROW(eval(parse("(set-cdr! (cons 1 2))")), scheme_error);
+    ASSERT_THROW(eval(parse("(set-cdr! (cons 1 2) 3 4)")), scheme_error);
+}
+
+TEST(SetCdr, ThrowsWithNonConsArg) {
+    ASSERT_THROW(eval(parse("(set-cdr! '() 2)")), scheme_error);
+}
+
+TEST(SetCdr, CanExtendAListInPlace) {
+    auto program = "((lambda (x) (set-cdr! (cdr x) (quote (3))) x)\
+                     (cons 1 (cons 2 '())))";
+    ASSERT_EQ(parse("(1 2 3)"), eval(parse(program)));
+}
+
+TEST(SetCdr, ReturnsFalseEvenWhenItMakesACycle) {
+    auto program = "((lambda (x) (set-cdr! x x)) (cons 1 2))";
+    ASSERT_FALSE(boolValue(eval(parse(program))));
+}
+
+TEST(SetCdr, LeavesACycleThatTypeErrorsCanStillDescribe) {
+    auto program = "((lambda (x) (set-cdr! x x) (+ 1 x)) (cons 1 2))";
+    try {
+        eval(parse(program));
+        FAIL() << "Expected a scheme_error";
+    } catch (const scheme_error& e) {
+        ASSERT_STREQ("Integer expected, got (1 ...)", e.what());
+    }
+}
+
 // string-length
 
 TEST(StringLength, ThrowsOnNoArgs) {
@@ -452,6 +516,11 @@ TEST(StringRef, RetrievesCharacterWithValidStringAndIndex) {
     ASSERT_EQ('u', charValue(eval(parse("(string-ref \"um\" 0)"))));
 }
 
+TEST(StringRef, ThrowsWhenIndexIsOutOfBounds) {
+    ASSERT_THROW(eval(parse("(string-ref \"um\" 2)")), scheme_error);
+    ASSERT_THROW(eval(parse("(string-ref \"um\" -1)")), scheme_error);
+}
+
 // cons?
 
 TEST(Consp, ThrowsWithNoArgs) {
@@ -515,6 +584,31 @@ TEST(Numberp, ReturnsFalseWithNonNumericArg) {
     ASSERT_FALSE(boolValue(eval(parse("(number? (cons 1 2))"))));
 }
 
+TEST(Numberp, ReturnsFalseWithCircularList) {
+    auto program = "((lambda (x) (set-cdr! x x) (number? x)) (cons 1 2))";
+    ASSERT_FALSE(boolValue(eval(parse(program))));
+}
+
+// string->symbol
+
+TEST(StringToSymbol, ThrowsWithNonStringArg) {
+    ASSERT_THROW(eval(parse("(string->symbol 'foo)")), scheme_error);
+}
+
+TEST(StringToSymbol, ReturnsTheInternedSymbol) {
+    ASSERT_TRUE(boolValue(eval(parse("(eq? (string->symbol \"foo\") 'foo)"))));
+}
+
+// symbol->string
+
+TEST(SymbolToString, ThrowsWithNonSymbolArg) {
+    ASSERT_THROW(eval(parse("(symbol->string \"foo\")")), scheme_error);
+}
+
+TEST(SymbolToString, ReturnsTheSymbolName) {
+    ASSERT_EQ("foo", stringValue(eval(parse("(symbol->string 'foo)"))));
+}
+
 // symbol?
 
 TEST(Symbolp, ThrowsWithNoArgs) {
@@ -557,3 +651,55 @@ TEST(Characterp, ReturnsFalseWithNonCharacterArg) {
     ASSERT_FALSE(boolValue(eval(parse("(character? (cons 1 2))"))));
     ASSERT_FALSE(boolValue(eval(parse("(character? (quote ()))"))));
 }
+
+// the standard environment
+
+TEST(StandardEnvironment, KeepsDefinitionsToItself) {
+    auto env = standardEnvironment();
+    auto other = standardEnvironment();
+    eval(parse("(define x 1)"), env);
+    eval(parse("(set! car cdr)"), env);
+    eval(parse("(define cons 2)"), env);
+    ASSERT_EQ(parse("(2)"), eval(parse("(car (quote (1 2)))"), env));
+    ASSERT_THROW(eval(parse("x"), other), scheme_error);
+    ASSERT_EQ(1, intValue(eval(parse("(car (cons 1 2))"), other)));
+    ASSERT_EQ(1, intValue(eval(parse("(car (cons 1 2))"),
+                               standardEnvironment())));
+}
+
+// typed primitives
+
+namespace {
+
+std::string repeat(const std::string& string, int times)
+{
+    std::string repeated;
+    for (int i = 0; i < times; ++i) repeated += string;
+    return repeated;
+}
+
+} // end namespace
+
+TEST(TypedPrimitive, UnboxesArgumentsAndBoxesTheResult) {
+    auto env = standardEnvironment();
+    addPrimitive(*env, "repeat", SCHEME_TYPED(repeat));
+    ASSERT_EQ("umum", stringValue(eval(parse("(repeat \"um\" 2)"), env)));
+}
+
+TEST(TypedPrimitive, ThrowsWithWrongNumberOfArgs) {
+    auto env = standardEnvironment();
+    addPrimitive(*env, "repeat", SCHEME_TYPED(repeat));
+    try {
+        eval(parse("(repeat \"um\")"), env);
+        FAIL();
+    } catch (const scheme_error& e) {
+        ASSERT_STREQ("repeat requires two arguments, passed 1", e.what());
+    }
+}
+
+TEST(TypedPrimitive, ThrowsWithWrongTypeOfArg) {
+    auto env = standardEnvironment();
+    addPrimitive(*env, "repeat", SCHEME_TYPED(repeat));
+    ASSERT_THROW(eval(parse("(repeat \"um\" #t)"), env), scheme_error);
+    ASSERT_THROW(eval(parse("(repeat 2 2)"), env), scheme_error);
+}
@@ -0,0 +1,107 @@
+#include <sstream>
+#include <string>
+#include "gtest/gtest.h"
+#include "builtins.hh"
+#include "compiler.hh"
+#include "eval.hh"
+#include "scheme_types.hh"
+#include "vm.hh"
+
+namespace {
+
+std::string listing(const std::string& source)
+{
+    std::ostringstream out;
+    disassemble(out, *compile(parse(source)));
+    return out.str();
+}
+
+SchemeExpr run(const std::string& source, EnvPointer env)
+{
+    return execute(compile(parse(source)), env);
+}
+
+} // end namespace
+
+TEST(Compiler, EndsCodeWithReturn) {
+    auto code = compile(parse("1"));
+    ASSERT_EQ(static_cast<std::uint16_t>(Opcode::Return),
+              code->instructions.back());
+}
+
+TEST(Compiler, ChecksSyntaxWhenCompiling) {
+    ASSERT_THROW(compile(parse("(lambda () (if #t))")), scheme_error);
+    ASSERT_THROW(compile(parse("(quote)")), scheme_error);
+}
+
+TEST(Compiler, CompilesLambdaBodiesToNestedFunctions) {
+    auto code = compile(parse("(lambda (x &rest y) (define z x) z)"));
+    ASSERT_EQ(1, code->functions.size());
+    const Code& function = *code->functions.front();
+    ASSERT_EQ(2, function.paramCount);
+    ASSERT_EQ(3, function.frameSize);
+    ASSERT_TRUE(function.hasRestParam);
+}
+
+TEST(Compiler, CompilesCallsInTailPositionToTailCalls) {
+    auto text = listing("(lambda (n) (if (f n) (begin (g) (h n)) (k)))");
+    ASSERT_NE(std::string::npos, text.find("Call               1"));
+    ASSERT_NE(std::string::npos, text.find("Call               0"));
+    ASSERT_NE(std::string::npos, text.find("TailCall           1"));
+    ASSERT_NE(std::string::npos, text.find("TailCall           0"));
+    ASSERT_EQ(std::string::npos, listing("(f)").find("TailCall"));
+}
+
+TEST(Disassembler, ListsInstructionsWithTheirOperands) {
+    auto text = listing("(if (< n 2) n 3)");
+    ASSERT_NE(std::string::npos, text.find("GlobalRef"));
+    ASSERT_NE(std::string::npos, text.find("JumpIfFalse"));
+    ASSERT_NE(std::string::npos, text.find("Call               2"));
+    ASSERT_NE(std::string::npos, text.find("; <"));
+}
+
+TEST(Disassembler, ListsNestedFunctions) {
+    auto text = listing("(lambda (x) (lambda () x))");
+    ASSERT_NE(std::string::npos, text.find("code.0: 1 parameters"));
+    ASSERT_NE(std::string::npos, text.find("code.0.0: 0 parameters"));
+    ASSERT_NE(std::string::npos, text.find("LocalRef           1 0 0"));
+}
+
+TEST(VM, RunsRecursiveFunctions) {
+    auto env = standardEnvironment();
+    run("(define fact (lambda (n) (if (= n 0) 1 (* n (fact (- n 1))))))",
+        env);
+    ASSERT_EQ(120, intValue(run("(fact 5)", env)));
+}
+
+TEST(VM, ClosuresCanBeCalledByTheTreeEvaluator) {
+    auto env = standardEnvironment();
+    run("(define add1 (lambda (x) (+ x 1)))", env);
+    ASSERT_EQ(3, intValue(analyze(parse("(add1 2)"))->execute(env.get())));
+    analyze(parse("(define twice (lambda (f x) (f (f x))))"))->execute(env.get());
+    ASSERT_EQ(4, intValue(run("(twice add1 2)", env)));
+}
+
+TEST(VM, RecoversAfterAnError) {
+    auto env = standardEnvironment();
+    run("(define f (lambda (x) (+ 1 (car x))))", env);
+    ASSERT_THROW(run("(f 1)", env), scheme_error);
+    ASSERT_EQ(3, intValue(run("(f (cons 2 3))", env)));
+}
+
+TEST(VM, RecursesDeeperThanTheNativeStack) {
+    auto env = standardEnvironment();
+    run("(define count (lambda (n) (if (= n 0) 0 (+ 1 (count (- n 1))))))",
+        env);
+    ASSERT_EQ(300000, intValue(run("(count 300000)", env)));
+}
+
+TEST(VM, ThrowsPastTheMaximumCallDepth) {
+    auto env = standardEnvironment();
+    run("(define count (lambda (n) (if (= n 0) 0 (+ 1 (count (- n 1))))))",
+        env);
+    setMaxCallDepth(1000);
+    ASSERT_THROW(run("(count 1000)", env), scheme_error);
+    ASSERT_EQ(999, intValue(run("(count 999)", env)));
+    setMaxCallDepth(defaultMaxCallDepth);
+}
@@ -19,6 +19,13 @@ TEST(Eval, ThrowsOnEmptyList) {
     ASSERT_THROW(eval(parse("()")), scheme_error);
 }
 
+TEST(Eval, TagsSpecialFormKeywordsWhenInterned) {
+    ASSERT_EQ(Keyword::If, keywordOf(parse("if")));
+    ASSERT_EQ(Keyword::Set, keywordOf(parse("set!")));
+    ASSERT_EQ(Keyword::None, keywordOf(parse("iff")));
+    ASSERT_EQ(Keyword::None, keywordOf(parse("\"if\"")));
+}
+
 TEST(Quote, ReturnsUnboundSymbolIntact) {
     ASSERT_EQ("foo", symbolValue(eval(parse("(quote foo)"))).string);
 }
@@ -32,7 +39,7 @@ TEST(Quote, ThrowsOnMoreThanOneArg) {
 }
 
 TEST(Define, MutatesEnvironment) {
-    auto env = std::make_shared<SchemeEnvironment>(SchemeEnvironment());
+    auto env = makeHandle<SchemeEnvironment>();
     eval(parse("(define x 2)"), env);
     ASSERT_EQ(2, intValue(eval(parse("x"), env)));
 }
@@ -69,7 +76,7 @@ TEST(Lambda, CanBeCalledDirectly) {
 }
 
 TEST(Lambda, CanProduceConstantFunction) {
-    auto env = std::make_shared<SchemeEnvironment>(SchemeEnvironment());
+    auto env = makeHandle<SchemeEnvironment>();
     eval(parse("(define three (lambda () 3))"), env);
     ASSERT_EQ(3, intValue(eval(parse("(three)"), env)));
 }
@@ -97,6 +104,72 @@ TEST(Lambda, ReturnsValueOfLastExprInBody) {
     ASSERT_EQ(3, intValue(eval(parse("((lambda () 1 2 3))"))));
 }
 
+TEST(Lambda, ClosesOverEnclosingParameters) {
+    auto env = standardEnvironment();
+    eval(parse("(define adder (lambda (n) (lambda (x) (+ x n))))"), env);
+    ASSERT_EQ(5, intValue(eval(parse("((adder 2) 3)"), env)));
+}
+
+TEST(Lambda, AllowsMutuallyRecursiveInternalDefines) {
+    auto env = standardEnvironment();
+    eval(parse("(define f (lambda (n)"
+               "  (define even (lambda (n) (if (= n 0) #t (odd (- n 1)))))"
+               "  (define odd (lambda (n) (if (= n 0) #f (even (- n 1)))))"
+               "  (even n)))"), env);
+    ASSERT_TRUE(boolValue(eval(parse("(f 10)"), env)));
+    ASSERT_FALSE(boolValue(eval(parse("(f 7)"), env)));
+    ASSERT_THROW(eval(parse("even"), env), scheme_error);
+}
+
+TEST(Lambda, ThrowsOnInternalDefineUsedBeforeItRuns) {
+    auto env = standardEnvironment();
+    eval(parse("(define f (lambda () (define y x) (define x 1) y))"), env);
+    ASSERT_THROW(eval(parse("(f)"), env), scheme_error);
+}
+
+TEST(Set, MutatesCapturedLocalVariable) {
+    auto env = standardEnvironment();
+    eval(parse("(define counter ((lambda (n) (lambda () (set! n (+ n 1)) n))"
+               "                 0))"), env);
+    eval(parse("(counter)"), env);
+    ASSERT_EQ(2, intValue(eval(parse("(counter)"), env)));
+}
+
+TEST(TailCall, LoopsWithoutGrowingTheStack) {
+    auto env = standardEnvironment();
+    eval(parse("(define loop (lambda (n) (if (= n 0) 0 (loop (- n 1)))))"),
+         env);
+    ASSERT_EQ(0, intValue(eval(parse("(loop 100000)"), env)));
+}
+
+TEST(TailCall, WorksThroughBeginAndOrAndMutualRecursion) {
+    auto env = standardEnvironment();
+    eval(parse("(define even (lambda (n) (or (= n 0) (odd (- n 1)))))"),
+         env);
+    eval(parse("(define odd (lambda (n)"
+               "  (and (not (= n 0)) (begin 1 (even (- n 1))))))"), env);
+    ASSERT_TRUE(boolValue(eval(parse("(even 100000)"), env)));
+    ASSERT_FALSE(boolValue(eval(parse("(odd 100000)"), env)));
+}
+
+TEST(TailCall, ReturnsValuesOfPrimitivesInTailPosition) {
+    auto env = standardEnvironment();
+    eval(parse("(define f (lambda (x) (if #t (+ x 1) 0)))"), env);
+    ASSERT_EQ(3, intValue(eval(parse("(f 2)"), env)));
+}
+
+TEST(TailCall, PassesMoreArgumentsThanFitInline) {
+    auto env = standardEnvironment();
+    eval(parse("(define total (lambda (xs)"
+               "  (if (null? xs) 0 (+ (car xs) (total (cdr xs))))))"), env);
+    eval(parse("(define sum (lambda (&rest xs) (total xs)))"), env);
+    eval(parse("(define rotate (lambda (n a b c d e f)"
+               "  (if (= n 0) (sum a b (* 10 c) d e f)"
+               "    (rotate (- n 1) f a b c d e))))"), env);
+    ASSERT_EQ(21 + 9 * 2, intValue(eval(parse("(rotate 7 1 2 3 4 5 6)"),
+                                        env)));
+}
+
 TEST(Or, ReturnsFalseWithoutArgs) {
     ASSERT_FALSE(boolValue(eval(parse("(or)"))));
 }
@@ -121,6 +194,24 @@ TEST(And, ReturnsLastExpressionWithAllTrueArgs) {
     ASSERT_EQ(3, intValue(eval(parse("(and 1 2 3)"))));
 }
 
+TEST(Analyze, ChecksSyntaxBeforeExecuting) {
+    auto env = standardEnvironment();
+    ASSERT_THROW(analyze(parse("(begin (define x 1) (if))")), scheme_error);
+    ASSERT_THROW(eval(parse("x"), env), scheme_error);
+}
+
+TEST(Analyze, ChecksLambdaBodiesWhenTheLambdaIsAnalyzed) {
+    ASSERT_THROW(analyze(parse("(lambda () (quote))")), scheme_error);
+}
+
+TEST(Analyze, ProducesNodesThatCanBeExecutedRepeatedly) {
+    auto env = standardEnvironment();
+    auto node = analyze(parse("(begin (set! x (+ x 1)) x)"));
+    eval(parse("(define x 0)"), env);
+    ASSERT_EQ(1, intValue(node->execute(env.get())));
+    ASSERT_EQ(2, intValue(node->execute(env.get())));
+}
+
 TEST(EvalStream, DoesNotThrowOnEmptyStream) {
     std::istringstream in;
     auto env = standardEnvironment();
@@ -135,12 +226,12 @@ TEST(EvalStream, MutatesEnvironment) {
 }
 
 TEST(Set, ThrowsOnUndefinedVariable) {
-    auto env = std::make_shared<SchemeEnvironment>(SchemeEnvironment());
+    auto env = makeHandle<SchemeEnvironment>();
     ASSERT_THROW(eval(parse("(set! x 3)"), env), scheme_error);
 }
 
 TEST(Set, RedefinesVariable) {
-    auto env = std::make_shared<SchemeEnvironment>(SchemeEnvironment());
+    auto env = makeHandle<SchemeEnvironment>();
     eval(parse("(define x 1)"), env);
     ASSERT_EQ(1, intValue(eval(parse("x"), env)));
     eval(parse("(set! x 2)"), env);
@@ -0,0 +1,370 @@
+#include <string>
+#include <tuple>
+#include "gtest/gtest.h"
+#include "builtins.hh"
+#include "eval.hh"
+#include "gc.hh"
+#include "parser.hh"
+#include "scheme_types.hh"
+
+namespace {
+
+SchemeExpr run(const std::string& source, EnvPointer env)
+{
+    return eval(parse(source), env);
+}
+
+std::size_t liveObjects()
+{
+    collectGarbage();
+    return heapStats().objects;
+}
+
+// A list long enough that marking it takes more than one slice.
+SchemeExpr longList()
+{
+    SchemeExpr list = Nil::Nil;
+    for (int i = 0; i < 10000; ++i) list = cons(i, list);
+    collectGarbage();
+    return list;
+}
+
+// Fills the nursery blocks a minor collection has just released.
+void churn()
+{
+    for (int i = 0; i < 100000; ++i) cons(i, i);
+}
+
+// Runs each test body on the tree evaluator and on the VM, with major
+// collections made in one pause and incrementally, in slices too short
+// to do more than the least work each time.
+class GarbageCollector
+    : public testing::TestWithParam<std::tuple<EvalMode, double>> {
+protected:
+    void SetUp() override {
+        setEvalMode(std::get<0>(GetParam()));
+        setPauseTarget(std::get<1>(GetParam()));
+    }
+
+    void TearDown() override {
+        setEvalMode(EvalMode::Tree);
+        setPauseTarget(0);
+        collectGarbage();
+    }
+};
+
+} // end namespace
+
+TEST_P(GarbageCollector, FreesCyclicLists) {
+    auto env = standardEnvironment();
+    run("(define x 0)", env);
+    auto before = liveObjects();
+    run("(define x (cons 1 2))", env);
+    run("(set-cdr! x x)", env);
+    ASSERT_EQ(before + 1, liveObjects());
+    run("(define x 0)", env);
+    ASSERT_EQ(before, liveObjects());
+}
+
+TEST_P(GarbageCollector, FreesClosuresThatReferToThemselves) {
+    auto env = standardEnvironment();
+    run("(define make (lambda ()"
+        "  (define loop (lambda (n) (if (= n 0) 0 (loop (- n 1)))))"
+        "  loop))", env);
+    run("(define f 0)", env);
+    auto before = liveObjects();
+    run("(define f (make))", env);
+    ASSERT_EQ(0, intValue(run("(f 10)", env)));
+    run("(define f 0)", env);
+    ASSERT_EQ(before, liveObjects());
+}
+
+TEST_P(GarbageCollector, KeepsClosureEnvironmentsAlive) {
+    auto env = standardEnvironment();
+    run("(define make-counter (lambda ()"
+        "  (define n 0)"
+        "  (lambda () (set! n (+ n 1)) n)))", env);
+    run("(define c (make-counter))", env);
+    run("(gc)", env);
+    run("(c)", env);
+    ASSERT_EQ(2, intValue(run("(c)", env)));
+}
+
+TEST_P(GarbageCollector, CollectsWhileProgramsRun) {
+    auto env = standardEnvironment();
+    run("(define build (lambda (n acc)"
+        "  (if (= n 0) acc (build (- n 1) (cons n acc)))))", env);
+    auto collections = heapStats().minorCollections;
+    run("(define xs (build 200000 (quote ())))", env);
+    ASSERT_LT(collections, heapStats().minorCollections);
+    ASSERT_EQ(200000, intValue(run("(length xs)", env)));
+    ASSERT_EQ(1, intValue(run("(car xs)", env)));
+}
+
+TEST_P(GarbageCollector, KeepsYoungPairsStoredInOldObjects) {
+    auto env = standardEnvironment();
+    run("(define x (cons 0 0))", env);
+    collectGarbage();
+    run("(set-car! x (cons 1 2))", env);
+    run("(define y (cons 3 4))", env);
+    collectPending();
+    churn();
+    ASSERT_EQ(1, intValue(run("(car (car x))", env)));
+    ASSERT_EQ(2, intValue(run("(cdr (car x))", env)));
+    ASSERT_EQ(4, intValue(run("(cdr y)", env)));
+}
+
+// Moves each string in a list one cell along at a time, with a slice
+// of an incremental collection in between. Wherever the marker has got
+// to, a string moves from a cell it hasn't reached into one it has,
+// and only the write barrier stops it being freed.
+TEST_P(GarbageCollector, KeepsValuesMovedWhileMarking) {
+    auto env = standardEnvironment();
+    run("(define build (lambda (n acc)"
+        "  (if (= n 0) acc"
+        "    (build (- n 1) (cons (symbol->string (quote s)) acc)))))", env);
+    run("(define rotate (lambda (xs)"
+        "  (if (null? (cdr xs)) 0"
+        "    (begin"
+        "      (define s (car xs))"
+        "      (set-car! xs (car (cdr xs)))"
+        "      (set-car! (cdr xs) s)"
+        "      (rotate (cdr xs))))))", env);
+    run("(define strings (lambda (xs)"
+        "  (if (null? xs) 0"
+        "    (+ (string-length (car xs)) (strings (cdr xs))))))", env);
+    run("(define xs (build 300 (quote ())))", env);
+    collectGarbage();
+
+    startCollection();
+    while (collectionInProgress()) {
+        run("(rotate xs)", env);
+        collectPending();
+        churn();
+    }
+    ASSERT_EQ(300, intValue(run("(strings xs)", env)));
+}
+
+// Only the frame of the call to the lambda adder returns is freed as
+// its call returns, since adder's frame is kept alive by that lambda.
+TEST_P(GarbageCollector, ReleasesFramesOfFunctionsWithoutClosures) {
+    auto env = standardEnvironment();
+    run("(define count (lambda (n) (if (= n 0) 0 (+ 1 (count (- n 1))))))",
+        env);
+    run("(define adder (lambda (n) (lambda (x) (+ x n))))", env);
+    auto before = heapStats().framesReleased;
+    ASSERT_EQ(100, intValue(run("(count 100)", env)));
+    auto released = heapStats().framesReleased;
+    ASSERT_LT(before, released);
+    ASSERT_EQ(3, intValue(run("((adder 1) 2)", env)));
+    ASSERT_EQ(released + 1, heapStats().framesReleased);
+}
+
+TEST_P(GarbageCollector, KeepsWhatEscapesARegion) {
+    auto env = standardEnvironment();
+    run("(define build (lambda (n acc)"
+        "  (if (= n 0) acc (build (- n 1) (cons n acc)))))", env);
+    run("(define kept 0)", env);
+    auto regions = heapStats().regions;
+    auto result = run("(with-region (lambda ()"
+                      "  (build 100000 (quote ()))"
+                      "  (set! kept (build 100 (quote ())))"
+                      "  (build 50 (quote ()))))", env);
+    churn();
+    collectPending();
+    ASSERT_EQ(regions + 1, heapStats().regions);
+    ASSERT_EQ(50, vectorFromExpr(result).size());
+    ASSERT_EQ(100, intValue(run("(length kept)", env)));
+    ASSERT_EQ(1, intValue(run("(car kept)", env)));
+}
+
+INSTANTIATE_TEST_CASE_P(AllModes, GarbageCollector,
+                        testing::Combine(testing::Values(EvalMode::Tree,
+                                                         EvalMode::Bytecode),
+                                         testing::Values(0.0, 1e-9)));
+
+TEST(Roots, SurviveCollection) {
+    SchemeExpr list = parse("(1 \"two\" (three))");
+    collectGarbage();
+    ASSERT_EQ(parse("(1 \"two\" (three))"), list);
+}
+
+TEST(Roots, ArePinnedInTheNursery) {
+    SchemeExpr pair = cons(1, cons(2, Nil::Nil));
+    auto before = heapStats().promoted;
+    collectPending();
+    churn();
+    ASSERT_EQ(parse("(1 2)"), pair);
+    ASSERT_EQ(before + 1, heapStats().promoted);
+}
+
+// After a minor collection, allocation starts at the beginning of a
+// nursery block, so the lists don't straddle two.
+TEST(Nursery, LaysListsOutInListOrder) {
+    collectPending();
+    SchemeExpr list = parse("(1 2 3 4)");
+    auto copy = append(list, Nil::Nil);
+    for (auto xs : { list, copy }) {
+        for (auto pair = asCons(xs); cdr(pair).isCons();
+             pair = asCons(cdr(pair))) {
+            ASSERT_EQ(pair + 1, asCons(cdr(pair)));
+        }
+    }
+}
+
+TEST(Regions, DeferMinorCollectionsUntilTheyClose) {
+    std::size_t minors;
+    {
+        Region region;
+        minors = heapStats().minorCollections;
+        churn();
+        ASSERT_FALSE(collectionDue);
+    }
+    ASSERT_EQ(minors + 1, heapStats().minorCollections);
+    churn();
+    ASSERT_TRUE(collectionDue);
+}
+
+// Pairs are freed with their blocks and marking keeps its own stack,
+// so neither a long list nor a deeply nested one can overflow the C++
+// stack when it's freed.
+TEST(Gc, FreesLongAndDeeplyNestedLists) {
+    SchemeExpr list = Nil::Nil;
+    SchemeExpr nested = Nil::Nil;
+    for (int i = 0; i < 1000000; ++i) {
+        list = cons(i, list);
+        nested = cons(nested, Nil::Nil);
+    }
+    collectGarbage();
+    list = nested = Nil::Nil;
+    ASSERT_LE(2000000, collectGarbage());
+}
+
+TEST(Gc, ReturnsTheNumberOfObjectsFreed) {
+    auto env = standardEnvironment();
+    run("(cons 1 (cons 2 3))", env);
+    ASSERT_LE(2, intValue(run("(gc)", env)));
+}
+
+TEST(IncrementalCollection, PausesInSlices) {
+    auto list = longList();
+    setPauseTarget(1e-9);
+    auto before = heapStats();
+    startCollection();
+    ASSERT_TRUE(collectionInProgress());
+    auto slices = 0;
+    while (collectionInProgress()) {
+        collectPending();
+        ++slices;
+    }
+    setPauseTarget(0);
+    ASSERT_LT(1, slices);
+    ASSERT_EQ(before.collections + 1, heapStats().collections);
+    ASSERT_EQ(10000, vectorFromExpr(list).size());
+}
+
+TEST(IncrementalCollection, IsFinishedByGc) {
+    auto list = longList();
+    setPauseTarget(1e-9);
+    startCollection();
+    auto collections = heapStats().collections;
+    collectGarbage();
+    setPauseTarget(0);
+    ASSERT_FALSE(collectionInProgress());
+    ASSERT_EQ(collections + 2, heapStats().collections);
+}
+
+// Enough lists and closures that a major collection marks in parallel.
+TEST(ParallelMarking, MarksWhatOneThreadDoes) {
+    auto env = standardEnvironment();
+    run("(define build (lambda (n acc)"
+        "  (if (= n 0) acc (build (- n 1) (cons n acc)))))", env);
+    run("(define lists (lambda (n acc)"
+        "  (if (= n 0) acc"
+        "    (lists (- n 1) (cons (build 300 (quote ())) acc)))))", env);
+    run("(define adders (lambda (n acc)"
+        "  (if (= n 0) acc"
+        "    (adders (- n 1) (cons (lambda (x) (+ x n)) acc)))))", env);
+    run("(define sum (lambda (xs acc)"
+        "  (if (null? xs) acc (sum (cdr xs) (+ acc (car xs))))))", env);
+    run("(define xs (lists 300 (quote ())))", env);
+    run("(define fs (adders 20000 (quote ())))", env);
+
+    setMarkThreads(1);
+    auto single = liveObjects();
+    setMarkThreads(4);
+    auto parallel = liveObjects();
+    run("(define fs 0)", env);
+    auto fewer = liveObjects();
+    setMarkThreads(0);
+
+    ASSERT_EQ(single, parallel);
+    ASSERT_LT(fewer + 40000, parallel);
+    ASSERT_EQ(45150, intValue(run("(sum (car xs) 0)", env)));
+    ASSERT_EQ(300, intValue(run("(length xs)", env)));
+}
+
+// Keeps one pair in twenty of a long list, so most of the old pair
+// space is free and the survivors are spread over every block.
+TEST(Compaction, MovesPairsOutOfSparseBlocks) {
+    auto env = standardEnvironment();
+    run("(define build (lambda (n acc)"
+        "  (if (= n 0) acc (build (- n 1) (cons (cons n n) acc)))))", env);
+    run("(define thin (lambda (xs k acc)"
+        "  (if (null? xs) acc"
+        "    (if (= k 0) (thin (cdr xs) 19 (cons (car xs) acc))"
+        "      (thin (cdr xs) (- k 1) acc)))))", env);
+    run("(define sum (lambda (xs acc)"
+        "  (if (null? xs) acc (sum (cdr xs) (+ acc (cdr (car xs)))))))",
+        env);
+    run("(define xs (build 100000 (quote ())))", env);
+    collectGarbage();
+    auto before = heapStats();
+    run("(define xs (thin xs 19 (quote ())))", env);
+    collectGarbage();
+    auto after = heapStats();
+
+    ASSERT_LT(before.compactions, after.compactions);
+    ASSERT_LT(after.bytes * 4, before.bytes);
+    ASSERT_EQ(5000, intValue(run("(length xs)", env)));
+    ASSERT_EQ(250050000, intValue(run("(sum xs 0)", env)));
+}
+
+TEST(PauseStats, ReportsPercentilesInMicroseconds) {
+    eval(parse("(gc)"));
+    auto stats = vectorFromExpr(eval(parse("(pause-stats)")));
+    ASSERT_EQ(4, stats.size());
+    ASSERT_LE(intValue(stats[0]), intValue(stats[1]));
+    ASSERT_LE(intValue(stats[1]), intValue(stats[2]));
+    ASSERT_LE(intValue(stats[2]), intValue(stats[3]));
+    ASSERT_LT(0, heapStats().longestPauseSeconds);
+}
+
+TEST(PoolStats, ReportsReuseOfFreedObjects) {
+    auto env = standardEnvironment();
+    run("(define count (lambda (n) (if (= n 0) 0 (+ 1 (count (- n 1))))))",
+        env);
+    run("(count 1000)", env);
+    auto pools = vectorFromExpr(run("(pool-stats)", env));
+    ASSERT_LT(0, pools.size());
+    auto recycled = 0;
+    for (const auto& pool : pools) {
+        auto stats = vectorFromExpr(pool);
+        ASSERT_EQ(4, stats.size());
+        ASSERT_EQ(0, intValue(stats[0]) % 16);
+        ASSERT_LE(intValue(stats[2]), intValue(stats[1]));
+        recycled += intValue(stats[2]);
+    }
+    ASSERT_LT(0, recycled);
+}
+
+TEST(HeapStats, CountsObjectsBytesAndCollections) {
+    auto stats = vectorFromExpr(eval(parse("(heap-stats)")));
+    ASSERT_EQ(4, stats.size());
+    ASSERT_LT(0, intValue(stats[0]));
+    ASSERT_LT(0, intValue(stats[1]));
+    auto collections = intValue(stats[2]);
+    eval(parse("(gc)"));
+    auto after = vectorFromExpr(eval(parse("(heap-stats)")));
+    ASSERT_EQ(collections + 1, intValue(after[2]));
+}
@@ -53,6 +53,22 @@ TEST(SymbolParser, ReadsSymbol) {
     ASSERT_EQ("foo", symbolValue(parse("foo")).string);
 }
 
+TEST(SymbolParser, InternsSymbols) {
+    ASSERT_EQ(&symbolValue(parse("foo")), &symbolValue(parse("foo")));
+    ASSERT_NE(&symbolValue(parse("foo")), &symbolValue(parse("bar")));
+}
+
+TEST(SymbolTable, CountsEachNameOnce) {
+    intern("symbol-table-test");
+    auto before = symbolTableStats();
+    intern("symbol-table-test");
+    ASSERT_EQ(before.symbols, symbolTableStats().symbols);
+    intern("symbol-table-test-2");
+    auto after = symbolTableStats();
+    ASSERT_EQ(before.symbols + 1, after.symbols);
+    ASSERT_GT(after.bytes, before.bytes);
+}
+
 TEST(ListParser, ReadsEmptyList) {
     ASSERT_TRUE(vectorFromExpr(parse("()")).empty());
 }
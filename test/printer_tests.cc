@@ -1,3 +1,4 @@
+#include <iomanip>
 #include <sstream>
 #include "gtest/gtest.h"
 #include "builtins.hh" // for scheme::cons
@@ -53,6 +54,34 @@ TEST(Printer, PrintsImproperListWithDotBeforeCdr) {
     ASSERT_EQ("(1 . 2)", s.str());
 }
 
+TEST(Printer, EndsAListThatLoopsBackWithAnEllipsis) {
+    std::ostringstream s;
+    s << eval(parse("((lambda (x) (set-cdr! (cdr x) x) x)"
+                    " (cons 1 (cons 2 '())))"));
+    ASSERT_EQ("(1 2 ...)", s.str());
+}
+
+TEST(Printer, PrintsAListThatContainsItselfAsAnEllipsis) {
+    std::ostringstream s;
+    s << eval(parse("((lambda (x) (set-car! x x) x) (cons 1 2))"));
+    ASSERT_EQ("(... . 2)", s.str());
+}
+
+TEST(Printer, PrintsSharedButAcyclicStructureInFull) {
+    std::ostringstream s;
+    s << eval(parse("((lambda (x) (cons x (cons x x))) (cons 1 '()))"));
+    ASSERT_EQ("((1) (1) 1)", s.str());
+}
+
+TEST(Printer, PadsTheWholeValueToTheFieldWidth) {
+    std::ostringstream s;
+    s << std::setw(9) << parse("(1 (2) 3)");
+    ASSERT_EQ("(1 (2) 3)", s.str());
+    s.str("");
+    s << std::setw(11) << parse("(1 (2) 3)");
+    ASSERT_EQ("  (1 (2) 3)", s.str());
+}
+
 TEST(Printer, PrintsStringWithDoubleQuotes) {
     std::ostringstream s;
     s << parse("\"um\"");
@@ -0,0 +1,11 @@
+#include "gtest/gtest.h"
+#include "eval.hh"
+
+// Runs the suites linked with it on the bytecode VM instead of the
+// tree-walking evaluator.
+int main(int argc, char **argv)
+{
+    setEvalMode(EvalMode::Bytecode);
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}